@@ -1,5 +1,6 @@
 #include "raylib.h"
 #include "raymath.h"
+#include "rlgl.h"
 #include "stdint.h"
 #include "string.h"
 #include "stdio.h"
@@ -119,16 +120,270 @@ static int GetNextUTF8Char(const char* text, int* index, int length) {
     return codepoint;
 }
 
+// ---- Glyph lookup tables ----
+// GetGlyphIndex() scans every glyph of the font for each codepoint. A table is kept per font
+// instead: the Latin ranges map straight to their glyph, the rest goes through a small hash,
+// and the advance of every glyph is kept next to it. Text measurement, the line breaker and
+// the renderer all go through it, so they agree on every width.
+//
+// Tables start with the glyphs the font already has and ask Raylib_glyph_loader for every
+// codepoint they have not seen yet, the loader rasterizes the glyph and appends it to the Font
+// in place. Codepoints the face does not have map to its '?'.
+
+#define RAYLIB_MAX_FONTS 16
+#define RAYLIB_GLYPH_DIRECT_SIZE 0x250 // ASCII up to Latin Extended-B
+#define RAYLIB_GLYPH_UNKNOWN (-2)      // not asked to the loader yet
+
+typedef struct {
+    int fontId;
+    int direct[RAYLIB_GLYPH_DIRECT_SIZE];
+    int *hash_codepoints;   // -1 for free slots
+    int *hash_glyphs;
+    unsigned hash_mask;
+    unsigned hash_count;
+    float *advances;        // per glyph, unscaled. NULL until the table is built
+    int advances_capacity;
+} Raylib_GlyphTable;
+
+// Loads the glyph of a codepoint into fonts[fontId], returns its index or -1 if the face
+// does not have it
+typedef int (*Raylib_GlyphLoader)(int fontId, int codepoint);
+
+static Raylib_GlyphTable Raylib_glyph_tables[RAYLIB_MAX_FONTS];
+static Raylib_GlyphTable Raylib_no_glyph_table; // fonts without table use GetGlyphIndex()
+static Raylib_GlyphLoader Raylib_glyph_loader;
+
+static inline unsigned Raylib_HashCodepoint(int codepoint, unsigned mask) {
+    return ((unsigned)codepoint * 2654435761u) & mask;
+}
+
+void Raylib_FreeGlyphTable(int fontId) {
+    Raylib_GlyphTable *table = &Raylib_glyph_tables[fontId];
+    free(table->hash_codepoints);
+    free(table->hash_glyphs);
+    free(table->advances);
+    memset(table, 0, sizeof(*table));
+}
+
+static void Raylib_ClearGlyphRuns(void);
+
+static void Raylib_AllocGlyphHash(Raylib_GlyphTable *table, unsigned capacity) {
+    table->hash_codepoints = malloc(capacity * sizeof(int));
+    table->hash_glyphs = malloc(capacity * sizeof(int));
+    if (!table->hash_codepoints || !table->hash_glyphs) {
+        perror("Error allocating glyph table");
+        exit(1);
+    }
+    table->hash_mask = capacity - 1;
+    table->hash_count = 0;
+    for (unsigned i = 0; i < capacity; i++) table->hash_codepoints[i] = -1;
+}
+
+static void Raylib_InsertGlyph(Raylib_GlyphTable *table, int codepoint, int glyph);
+
+static void Raylib_GrowGlyphHash(Raylib_GlyphTable *table) {
+    int *old_codepoints = table->hash_codepoints;
+    int *old_glyphs = table->hash_glyphs;
+    unsigned old_capacity = table->hash_mask + 1;
+
+    Raylib_AllocGlyphHash(table, old_capacity * 2);
+    for (unsigned i = 0; i < old_capacity; i++) {
+        if (old_codepoints[i] != -1) Raylib_InsertGlyph(table, old_codepoints[i], old_glyphs[i]);
+    }
+    free(old_codepoints);
+    free(old_glyphs);
+}
+
+static void Raylib_InsertGlyph(Raylib_GlyphTable *table, int codepoint, int glyph) {
+    if (codepoint >= 0 && codepoint < RAYLIB_GLYPH_DIRECT_SIZE) {
+        table->direct[codepoint] = glyph;
+        return;
+    }
+    if ((table->hash_count + 1) * 2 > table->hash_mask + 1) Raylib_GrowGlyphHash(table);
+
+    unsigned slot = Raylib_HashCodepoint(codepoint, table->hash_mask);
+    while (table->hash_codepoints[slot] != -1 && table->hash_codepoints[slot] != codepoint) {
+        slot = (slot + 1) & table->hash_mask;
+    }
+    if (table->hash_codepoints[slot] == -1) table->hash_count++;
+    table->hash_codepoints[slot] = codepoint;
+    table->hash_glyphs[slot] = glyph;
+}
+
+static void Raylib_StoreAdvance(Raylib_GlyphTable *table, const Font *font, int glyph) {
+    if (glyph >= table->advances_capacity) {
+        int capacity = table->advances_capacity ? table->advances_capacity : 128;
+        while (capacity <= glyph) capacity *= 2;
+        table->advances = realloc(table->advances, capacity * sizeof(float));
+        if (!table->advances) {
+            perror("Error allocating glyph table");
+            exit(1);
+        }
+        table->advances_capacity = capacity;
+    }
+    float advance = font->glyphs[glyph].advanceX;
+    if (advance == 0.0f) advance = font->recs[glyph].width + font->glyphs[glyph].offsetX;
+    table->advances[glyph] = advance;
+}
+
+// Table for a font whose glyphs come from the loader as the text needs them, starting with
+// the glyphs the font already has
+void Raylib_CreateLazyGlyphTable(int fontId, const Font *font, Raylib_GlyphLoader loader) {
+    Raylib_FreeGlyphTable(fontId);
+    Raylib_ClearGlyphRuns();
+    Raylib_GlyphTable *table = &Raylib_glyph_tables[fontId];
+    table->fontId = fontId;
+    Raylib_AllocGlyphHash(table, 256);
+    table->advances_capacity = 128;
+    table->advances = malloc(table->advances_capacity * sizeof(float));
+    if (!table->advances) {
+        perror("Error allocating glyph table");
+        exit(1);
+    }
+    for (int i = 0; i < RAYLIB_GLYPH_DIRECT_SIZE; i++) table->direct[i] = RAYLIB_GLYPH_UNKNOWN;
+    for (int i = font->glyphCount - 1; i >= 0; i--) {
+        Raylib_StoreAdvance(table, font, i);
+        Raylib_InsertGlyph(table, font->glyphs[i].value, i);
+    }
+    Raylib_glyph_loader = loader;
+}
+
+void Raylib_FreeGlyphTables(void) {
+    for (int i = 0; i < RAYLIB_MAX_FONTS; i++) Raylib_FreeGlyphTable(i);
+}
+
+static inline Raylib_GlyphTable *Raylib_GetGlyphTable(const Font *font, int fontId) {
+    if (!font->glyphs || fontId < 0 || fontId >= RAYLIB_MAX_FONTS) return &Raylib_no_glyph_table;
+    return &Raylib_glyph_tables[fontId];
+}
+
+static int Raylib_FindGlyph(Raylib_GlyphTable *table, Font *font, int codepoint);
+
+static int Raylib_LoadGlyph(Raylib_GlyphTable *table, Font *font, int codepoint) {
+    int glyph = Raylib_glyph_loader(table->fontId, codepoint);
+    if (glyph >= 0) {
+        Raylib_StoreAdvance(table, font, glyph);
+    } else if (codepoint != '?') {
+        glyph = Raylib_FindGlyph(table, font, '?');
+    }
+    Raylib_InsertGlyph(table, codepoint, glyph);
+    return glyph;
+}
+
+// The font is updated in place when the table loads a glyph, callers must not hold copies
+// of it across this call
+static int Raylib_FindGlyph(Raylib_GlyphTable *table, Font *font, int codepoint) {
+    if (!table->advances) return GetGlyphIndex(*font, codepoint);
+
+    int glyph = RAYLIB_GLYPH_UNKNOWN;
+    if (codepoint >= 0 && codepoint < RAYLIB_GLYPH_DIRECT_SIZE) {
+        glyph = table->direct[codepoint];
+    } else {
+        unsigned slot = Raylib_HashCodepoint(codepoint, table->hash_mask);
+        while (table->hash_codepoints[slot] != -1) {
+            if (table->hash_codepoints[slot] == codepoint) {
+                glyph = table->hash_glyphs[slot];
+                break;
+            }
+            slot = (slot + 1) & table->hash_mask;
+        }
+    }
+    if (glyph == RAYLIB_GLYPH_UNKNOWN) glyph = Raylib_LoadGlyph(table, font, codepoint);
+    return glyph;
+}
+
+// Unscaled advance of a glyph, in font pixels
+static inline float Raylib_GlyphAdvance(const Raylib_GlyphTable *table, const Font *font, int glyph) {
+    if (glyph < 0 || glyph >= font->glyphCount) return font->baseSize * 0.8f; // ancho estimado fallback
+    if (table->advances) return table->advances[glyph];
+
+    float advance = font->glyphs[glyph].advanceX;
+    if (advance == 0.0f) advance = font->recs[glyph].width + font->glyphs[glyph].offsetX;
+    return advance;
+}
+
+// ---- Glyph selection ----
+// Text measurement, the line breaker and the glyph runs all pick the glyph of a codepoint here,
+// so the measured widths are the drawn ones. Emoji come from the emoji font and the rest from
+// the text font, each falling back to the other. Codepoints neither has are drawn as U+FFFD of
+// raylib's default font.
+
+static bool is_emoji_codepoint(int cp) {
+    return (cp >= 0x1F300 && cp <= 0x1F9FF) ||  // símbolos, pictogramas
+           (cp >= 0x2600 && cp <= 0x26FF) ||    // misc symbols
+           (cp >= 0x2700 && cp <= 0x27BF) ||    // dingbats
+           (cp == 0x00A9) || (cp == 0x00AE) ||  // copyright
+           (cp >= 0x203C && cp <= 0x3299);      // otros emojis comunes
+}
+
+typedef enum {
+    RAYLIB_RUN_TEXTURE_TEXT,
+    RAYLIB_RUN_TEXTURE_EMOJI,
+    RAYLIB_RUN_TEXTURE_DEFAULT,
+} Raylib_RunTexture;
+
+typedef struct {
+    Font *font;
+    Raylib_GlyphTable *table;
+    int glyph;
+    Raylib_RunTexture texture;
+} Raylib_GlyphChoice;
+
+static int Raylib_emoji_font = -1;  // the text font itself until set
+static Font Raylib_default_font;
+
+void Raylib_SetEmojiFont(int fontId) {
+    if (fontId != Raylib_emoji_font) Raylib_ClearGlyphRuns();
+    Raylib_emoji_font = fontId;
+}
+
+static bool Raylib_TryGlyph(Raylib_GlyphChoice *choice, Font *fonts, int fontId, int codepoint,
+                            Raylib_RunTexture texture) {
+    Font *font = &fonts[fontId];
+    if (!font->glyphs) return false;
+    Raylib_GlyphTable *table = Raylib_GetGlyphTable(font, fontId);
+    int glyph = Raylib_FindGlyph(table, font, codepoint);
+    if (glyph < 0 || glyph >= font->glyphCount || font->glyphs[glyph].advanceX == 0) return false;
+    *choice = (Raylib_GlyphChoice) { font, table, glyph, texture };
+    return true;
+}
+
+static Raylib_GlyphChoice Raylib_PickGlyph(Font *fonts, int fontId, int codepoint) {
+    int emojiId = Raylib_emoji_font >= 0 ? Raylib_emoji_font : fontId;
+    bool isEmoji = is_emoji_codepoint(codepoint);
+    Raylib_GlyphChoice choice;
+    if (Raylib_TryGlyph(&choice, fonts, isEmoji ? emojiId : fontId, codepoint,
+                        isEmoji ? RAYLIB_RUN_TEXTURE_EMOJI : RAYLIB_RUN_TEXTURE_TEXT)
+            || Raylib_TryGlyph(&choice, fonts, isEmoji ? fontId : emojiId, codepoint,
+                               isEmoji ? RAYLIB_RUN_TEXTURE_TEXT : RAYLIB_RUN_TEXTURE_EMOJI)) {
+        return choice;
+    }
+    Raylib_default_font = GetFontDefault();
+    return (Raylib_GlyphChoice) {
+        .font = &Raylib_default_font,
+        .table = &Raylib_no_glyph_table,
+        .glyph = GetGlyphIndex(Raylib_default_font, 0xFFFD),
+        .texture = RAYLIB_RUN_TEXTURE_DEFAULT,
+    };
+}
+
+// Pen advance of a choice at the given size, letter spacing included
+static inline float Raylib_ChoiceAdvance(const Raylib_GlyphChoice *choice, float fontSize,
+                                         float letterSpacing) {
+    float scale = fontSize / choice->font->baseSize;
+    return (Raylib_GlyphAdvance(choice->table, choice->font, choice->glyph) + letterSpacing) * scale;
+}
+
+static inline float Raylib_CodepointAdvance(Font *fonts, int fontId, int codepoint,
+                                            float fontSize, float letterSpacing) {
+    Raylib_GlyphChoice choice = Raylib_PickGlyph(fonts, fontId, codepoint);
+    return Raylib_ChoiceAdvance(&choice, fontSize, letterSpacing);
+}
+
 static inline Clay_Dimensions Raylib_MeasureText(Clay_StringSlice text,
         Clay_TextElementConfig *config, void *userData) 
 {
     Font *fonts = (Font *)userData;
-    Font font = fonts[config->fontId];
-    if (!font.glyphs) font = GetFontDefault();
-
-    const float scale = config->fontSize / (float)font.baseSize;
-    const float spacing = config->letterSpacing * scale;
-
     float maxWidth = 0.0f;
     float lineWidth = 0.0f;
     float height = config->fontSize;
@@ -147,23 +402,317 @@ static inline Clay_Dimensions Raylib_MeasureText(Clay_StringSlice text,
             continue;
         }
 
-        int glyphIndex = GetGlyphIndex(font, codepoint);
-        float adv = 0.0f;
+        lineWidth += Raylib_CodepointAdvance(fonts, config->fontId, codepoint, config->fontSize,
+                                             config->letterSpacing);
+    }
+
+    if (lineWidth > maxWidth) maxWidth = lineWidth;
+
+    return (Clay_Dimensions){ maxWidth, height };
+}
+
+// ---- Glyph run cache ----
+// The glyphs of a text command are positioned once, relative to the text origin, and kept
+// across frames keyed by the text bytes and style. Drawing a cached run only translates it and
+// submits one quad batch per texture, instead of a decode, lookup and draw call per glyph.
+
+#define RAYLIB_RUN_TEXTURES 3                 // text font, emoji font, default font
+#define RAYLIB_GLYPH_RUN_MAX_QUADS (1 << 20)  // start over past this, old runs pile up
+#define RAYLIB_GLYPH_RUN_MAX_TEXT (4 << 20)   // bytes of text kept for the runs, likewise
+
+typedef struct {
+    float x, y, width, height;  // relative to the text origin
+    Rectangle source;           // in texture pixels, glyph atlases may grow under the run
+} Raylib_GlyphQuad;
+
+typedef struct {
+    uint64_t hash;              // of the text bytes, 0 for free slots
+    int length;
+    unsigned text_offset;       // copy of the text bytes in the cache, to tell collisions apart
+    uint16_t fontId;
+    uint16_t fontSize;
+    uint16_t letterSpacing;
+    unsigned first_quad;        // quads grouped by texture, in Raylib_RunTexture order
+    unsigned quad_counts[RAYLIB_RUN_TEXTURES];
+} Raylib_GlyphRun;
+
+typedef struct {
+    Raylib_GlyphRun *runs;
+    unsigned capacity;          // power of two
+    unsigned count;
+    Raylib_GlyphQuad *quads;
+    unsigned quad_count;
+    unsigned quads_capacity;
+    char *text;
+    unsigned text_size;
+    unsigned text_capacity;
+    struct Raylib_ScratchQuad *scratch; // quads of the run being built, before grouping
+    unsigned scratch_count;
+    unsigned scratch_capacity;
+} Raylib_GlyphRunCache;
+
+typedef struct Raylib_ScratchQuad {
+    Raylib_GlyphQuad quad;
+    Raylib_RunTexture texture;
+} Raylib_ScratchQuad;
+
+static Raylib_GlyphRunCache Raylib_glyph_runs;
+
+static void *Raylib_GrowArray(void *array, unsigned *capacity, unsigned needed, size_t item_size) {
+    if (*capacity >= needed) return array;
+    unsigned new_capacity = *capacity ? *capacity * 2 : 1024;
+    while (new_capacity < needed) new_capacity *= 2;
+    array = realloc(array, new_capacity * item_size);
+    if (!array) {
+        perror("Error allocating glyph runs");
+        exit(1);
+    }
+    *capacity = new_capacity;
+    return array;
+}
+
+static void Raylib_ClearGlyphRuns(void) {
+    Raylib_GlyphRunCache *cache = &Raylib_glyph_runs;
+    for (unsigned i = 0; i < cache->capacity; i++) cache->runs[i].hash = 0;
+    cache->count = 0;
+    cache->quad_count = 0;
+    cache->text_size = 0;
+}
 
-        if (glyphIndex >= 0 && glyphIndex < font.glyphCount) {
-            adv = font.glyphs[glyphIndex].advanceX;
-            if (adv == 0.0f)
-                adv = font.recs[glyphIndex].width + font.glyphs[glyphIndex].offsetX;
-        } else {
-            adv = font.baseSize * 0.8f; // ancho estimado fallback
+void Raylib_FreeGlyphRuns(void) {
+    Raylib_GlyphRunCache *cache = &Raylib_glyph_runs;
+    free(cache->runs);
+    free(cache->quads);
+    free(cache->text);
+    free(cache->scratch);
+    memset(cache, 0, sizeof(*cache));
+}
+
+static uint64_t Raylib_HashText(const char *text, int length) {
+    uint64_t hash = 1469598103934665603ull; // FNV-1a
+    for (int i = 0; i < length; i++) {
+        hash ^= (unsigned char)text[i];
+        hash *= 1099511628211ull;
+    }
+    return hash ? hash : 1;
+}
+
+// Slot of the run, either its entry or the free slot where it goes
+static Raylib_GlyphRun *Raylib_GlyphRunSlot(uint64_t hash, int length, const Clay_TextRenderData *text) {
+    Raylib_GlyphRunCache *cache = &Raylib_glyph_runs;
+    unsigned mask = cache->capacity - 1;
+    unsigned slot = (unsigned)(hash ^ (hash >> 32)) & mask;
+    while (cache->runs[slot].hash != 0) {
+        Raylib_GlyphRun *run = &cache->runs[slot];
+        if (run->hash == hash && run->length == length && run->fontId == text->fontId
+                && run->fontSize == text->fontSize && run->letterSpacing == text->letterSpacing
+                && memcmp(cache->text + run->text_offset, text->stringContents.chars, length) == 0) {
+            break;
         }
+        slot = (slot + 1) & mask;
+    }
+    return &cache->runs[slot];
+}
 
-        lineWidth += adv * scale + spacing;
+static void Raylib_GrowGlyphRunTable(void) {
+    Raylib_GlyphRunCache *cache = &Raylib_glyph_runs;
+    Raylib_GlyphRun *old_runs = cache->runs;
+    unsigned old_capacity = cache->capacity;
+
+    cache->capacity = old_capacity ? old_capacity * 2 : 1024;
+    cache->runs = calloc(cache->capacity, sizeof(Raylib_GlyphRun));
+    if (!cache->runs) {
+        perror("Error allocating glyph runs");
+        exit(1);
+    }
+    unsigned mask = cache->capacity - 1;
+    for (unsigned i = 0; i < old_capacity; i++) {
+        if (old_runs[i].hash == 0) continue;
+        unsigned slot = (unsigned)(old_runs[i].hash ^ (old_runs[i].hash >> 32)) & mask;
+        while (cache->runs[slot].hash != 0) slot = (slot + 1) & mask;
+        cache->runs[slot] = old_runs[i];
     }
+    free(old_runs);
+}
 
-    if (lineWidth > maxWidth) maxWidth = lineWidth;
+// Same placement as DrawTextCodepoint(), x being the pen position from the text origin
+static void Raylib_PushGlyphQuad(const Font *font, int glyph, Raylib_RunTexture texture,
+                                 float x, float fontSize) {
+    Raylib_GlyphRunCache *cache = &Raylib_glyph_runs;
+    Rectangle rec = font->recs[glyph];
+    if (rec.width <= 0 || rec.height <= 0) return; // Spaces
+
+    cache->scratch = Raylib_GrowArray(cache->scratch, &cache->scratch_capacity,
+                                      cache->scratch_count + 1, sizeof(Raylib_ScratchQuad));
+    float scale = fontSize / font->baseSize;
+    float padding = (float)font->glyphPadding;
+    float width = rec.width + 2.0f * padding;
+    float height = rec.height + 2.0f * padding;
+
+    cache->scratch[cache->scratch_count++] = (Raylib_ScratchQuad) {
+        .quad = {
+            .x = x + (font->glyphs[glyph].offsetX - padding) * scale,
+            .y = (font->glyphs[glyph].offsetY - padding) * scale,
+            .width = width * scale,
+            .height = height * scale,
+            .source = { rec.x - padding, rec.y - padding, width, height },
+        },
+        .texture = texture,
+    };
+}
 
-    return (Clay_Dimensions){ maxWidth, height };
+// Lays out the glyphs of the text into the run, with the glyphs and advances
+// Raylib_MeasureText() measured it with
+static void Raylib_BuildGlyphRun(Raylib_GlyphRun *run, const Clay_TextRenderData *text,
+                                 Font *fonts) {
+    Raylib_GlyphRunCache *cache = &Raylib_glyph_runs;
+    float fontSize = (float)text->fontSize;
+    float letterSpacing = (float)text->letterSpacing;
+
+    cache->scratch_count = 0;
+    float x = 0;
+    const char *p = text->stringContents.chars;
+    int remaining = text->stringContents.length;
+
+    while (remaining > 0) {
+        int bytes = 0;
+        int cp = GetCodepointNext(p, &bytes);
+        if (bytes <= 0) break;
+
+        Raylib_GlyphChoice choice = Raylib_PickGlyph(fonts, text->fontId, cp);
+        Raylib_PushGlyphQuad(choice.font, choice.glyph, choice.texture, x, fontSize);
+        x += Raylib_ChoiceAdvance(&choice, fontSize, letterSpacing);
+
+        p += bytes;
+        remaining -= bytes;
+    }
+
+    // Grouped by texture, each group is drawn as a single batch
+    cache->quads = Raylib_GrowArray(cache->quads, &cache->quads_capacity,
+                                    cache->quad_count + cache->scratch_count, sizeof(Raylib_GlyphQuad));
+    run->first_quad = cache->quad_count;
+    for (int t = 0; t < RAYLIB_RUN_TEXTURES; t++) {
+        run->quad_counts[t] = 0;
+        for (unsigned i = 0; i < cache->scratch_count; i++) {
+            if (cache->scratch[i].texture != (Raylib_RunTexture)t) continue;
+            cache->quads[cache->quad_count++] = cache->scratch[i].quad;
+            run->quad_counts[t]++;
+        }
+    }
+}
+
+static const Raylib_GlyphRun *Raylib_GetGlyphRun(const Clay_TextRenderData *text, Font *fonts) {
+    Raylib_GlyphRunCache *cache = &Raylib_glyph_runs;
+    if (cache->quad_count > RAYLIB_GLYPH_RUN_MAX_QUADS
+            || cache->text_size > RAYLIB_GLYPH_RUN_MAX_TEXT) {
+        Raylib_ClearGlyphRuns();
+    }
+    if ((cache->count + 1) * 2 > cache->capacity) {
+        Raylib_GrowGlyphRunTable();
+    }
+
+    int length = text->stringContents.length;
+    uint64_t hash = Raylib_HashText(text->stringContents.chars, length);
+    Raylib_GlyphRun *run = Raylib_GlyphRunSlot(hash, length, text);
+    if (run->hash != 0) {
+        return run;
+    }
+
+    cache->text = Raylib_GrowArray(cache->text, &cache->text_capacity, cache->text_size + length, 1);
+    memcpy(cache->text + cache->text_size, text->stringContents.chars, length);
+    cache->count++;
+    *run = (Raylib_GlyphRun) {
+        .hash = hash,
+        .length = length,
+        .text_offset = cache->text_size,
+        .fontId = text->fontId,
+        .fontSize = text->fontSize,
+        .letterSpacing = text->letterSpacing,
+    };
+    cache->text_size += length;
+    Raylib_BuildGlyphRun(run, text, fonts);
+    return run;
+}
+
+// ---- Distance field text ----
+// Glyph atlases may hold signed distance fields instead of coverage, the glyph edge being at
+// alpha 0.5. The shader rebuilds an antialiased edge about one screen pixel wide at whatever
+// scale the glyph is drawn, so a single bake stays sharp at every zoom level.
+
+static const char *Raylib_sdf_fragment_shader =
+    "#version 330\n"
+    "in vec2 fragTexCoord;\n"
+    "in vec4 fragColor;\n"
+    "uniform sampler2D texture0;\n"
+    "uniform vec4 colDiffuse;\n"
+    "out vec4 finalColor;\n"
+    "void main() {\n"
+    "    float distance = texture(texture0, fragTexCoord).a - 0.5;\n"
+    "    float change = length(vec2(dFdx(distance), dFdy(distance)));\n"
+    "    float alpha = smoothstep(-change, change, distance);\n"
+    "    finalColor = vec4(fragColor.rgb, fragColor.a * alpha) * colDiffuse;\n"
+    "}\n";
+
+static Shader Raylib_sdf_shader;
+static bool Raylib_sdf_enabled;
+
+// Returns false if the shader cannot be compiled, fonts must then be baked as coverage
+bool Raylib_LoadSdfShader(void) {
+    Raylib_sdf_shader = LoadShaderFromMemory(NULL, Raylib_sdf_fragment_shader);
+    Raylib_sdf_enabled = Raylib_sdf_shader.id != 0 && Raylib_sdf_shader.id != rlGetShaderIdDefault();
+    return Raylib_sdf_enabled;
+}
+
+void Raylib_UnloadSdfShader(void) {
+    if (Raylib_sdf_enabled) UnloadShader(Raylib_sdf_shader);
+    Raylib_sdf_enabled = false;
+}
+
+// The shader is switched only when the kind of texture changes, so runs of text share it.
+// The default font, which stands in for faces that could not be opened, holds coverage.
+static void Raylib_UseSdfShader(bool *active, Texture2D texture) {
+    bool use = Raylib_sdf_enabled && texture.id != GetFontDefault().texture.id;
+    if (use == *active) return;
+    if (use) BeginShaderMode(Raylib_sdf_shader);
+    else EndShaderMode();
+    *active = use;
+}
+
+static void Raylib_DrawGlyphRun(const Raylib_GlyphRun *run, const Texture2D *textures,
+                                float x, float y, Color tint, bool *sdfActive) {
+    const Raylib_GlyphQuad *quad = Raylib_glyph_runs.quads + run->first_quad;
+    for (int t = 0; t < RAYLIB_RUN_TEXTURES; t++) {
+        unsigned count = run->quad_counts[t];
+        if (count == 0) continue;
+
+        Raylib_UseSdfShader(sdfActive, textures[t]);
+        float du = 1.0f / textures[t].width;
+        float dv = 1.0f / textures[t].height;
+        rlSetTexture(textures[t].id);
+        rlBegin(RL_QUADS);
+        rlColor4ub(tint.r, tint.g, tint.b, tint.a);
+        rlNormal3f(0.0f, 0.0f, 1.0f);
+        for (unsigned i = 0; i < count; i++, quad++) {
+            float left = x + quad->x;
+            float top = y + quad->y;
+            float right = left + quad->width;
+            float bottom = top + quad->height;
+            float u0 = quad->source.x * du;
+            float v0 = quad->source.y * dv;
+            float u1 = (quad->source.x + quad->source.width) * du;
+            float v1 = (quad->source.y + quad->source.height) * dv;
+            rlTexCoord2f(u0, v0);
+            rlVertex2f(left, top);
+            rlTexCoord2f(u0, v1);
+            rlVertex2f(left, bottom);
+            rlTexCoord2f(u1, v1);
+            rlVertex2f(right, bottom);
+            rlTexCoord2f(u1, v0);
+            rlVertex2f(right, top);
+        }
+        rlEnd();
+        rlSetTexture(0);
+    }
 }
 
 void Clay_Raylib_Initialize(int width, int height, const char *title,
@@ -182,74 +731,32 @@ void Clay_Raylib_Close() {
     CloseWindow();
 }
 
-static bool is_emoji_codepoint(int cp) {
-    return (cp >= 0x1F300 && cp <= 0x1F9FF) ||  // símbolos, pictogramas
-           (cp >= 0x2600 && cp <= 0x26FF) ||    // misc symbols
-           (cp >= 0x2700 && cp <= 0x27BF) ||    // dingbats
-           (cp == 0x00A9) || (cp == 0x00AE) ||  // copyright
-           (cp >= 0x203C && cp <= 0x3299);      // otros emojis comunes
-}
+void Clay_Raylib_Render(Clay_RenderCommandArray renderCommands, Font* fonts) {
+    bool sdfActive = false;
 
-void Clay_Raylib_Render(Clay_RenderCommandArray renderCommands, Font* fonts,
-                        int emoji_font_index) {
     for (int j = 0; j < renderCommands.length; j++) {
         Clay_RenderCommand *renderCommand = Clay_RenderCommandArray_Get(&renderCommands, j);
         Clay_BoundingBox boundingBox = {roundf(renderCommand->boundingBox.x), roundf(renderCommand->boundingBox.y), roundf(renderCommand->boundingBox.width), roundf(renderCommand->boundingBox.height)};
 
+        if (sdfActive && renderCommand->commandType != CLAY_RENDER_COMMAND_TYPE_TEXT) {
+            EndShaderMode();
+            sdfActive = false;
+        }
+
         switch (renderCommand->commandType) {
         case CLAY_RENDER_COMMAND_TYPE_TEXT: {
             Clay_TextRenderData *textData = &renderCommand->renderData.text;
-            Font baseFont = fonts[textData->fontId];
-            Font emojiFont = fonts[emoji_font_index];
-
-            float x = boundingBox.x;
-            float y = boundingBox.y;
-            float fontSize = (float)textData->fontSize;
-            float spacing = (float)textData->letterSpacing;
-            Color color = CLAY_COLOR_TO_RAYLIB_COLOR(textData->textColor);
-
-            const char *p = textData->stringContents.chars;
-            int remaining = textData->stringContents.length;
-
-            while (remaining > 0) {
-                int bytes = 0;
-                int cp = GetCodepointNext(p, &bytes);
-                if (bytes <= 0) break;
-
-                bool isEmoji = is_emoji_codepoint(cp);
-                Font *font = isEmoji ? &emojiFont : &baseFont;
-
-                int glyphIndex = GetGlyphIndex(*font, cp);
-                if (glyphIndex < 0 || glyphIndex >= font->glyphCount
-                        || font->glyphs[glyphIndex].advanceX == 0) {
-                    font = isEmoji ? &baseFont : &emojiFont;  // fallback cruzado
-                    glyphIndex = GetGlyphIndex(*font, cp);
-                    if (glyphIndex < 0 || glyphIndex >= font->glyphCount
-                            || font->glyphs[glyphIndex].advanceX == 0) {
-                        DrawTextEx(GetFontDefault(), "�", (Vector2) {
-                            x, y
-                        }, fontSize, spacing, color);
-                        x += fontSize * 0.6f + spacing;
-                        p += bytes;
-                        remaining -= bytes;
-                        continue;
-                    }
-                }
-
-                DrawTextCodepoint(*font, cp, (Vector2) {
-                    x, y
-                }, fontSize, color);
-
-                float advance = font->glyphs[glyphIndex].advanceX;
-                if (advance == 0) {
-                    Rectangle rec = font->recs[glyphIndex];
-                    advance = rec.width + font->glyphs[glyphIndex].offsetX;
-                }
-                x += advance * (fontSize / font->baseSize) + spacing;
-
-                p += bytes;
-                remaining -= bytes;
-            }
+            if (textData->stringContents.length == 0) break;
+
+            const Raylib_GlyphRun *run = Raylib_GetGlyphRun(textData, fonts);
+            int emojiFont = Raylib_emoji_font >= 0 ? Raylib_emoji_font : textData->fontId;
+            Texture2D textures[RAYLIB_RUN_TEXTURES] = {
+                [RAYLIB_RUN_TEXTURE_TEXT] = fonts[textData->fontId].texture,
+                [RAYLIB_RUN_TEXTURE_EMOJI] = fonts[emojiFont].texture,
+                [RAYLIB_RUN_TEXTURE_DEFAULT] = GetFontDefault().texture,
+            };
+            Raylib_DrawGlyphRun(run, textures, boundingBox.x, boundingBox.y,
+                                CLAY_COLOR_TO_RAYLIB_COLOR(textData->textColor), &sdfActive);
             break;
         }
 
@@ -389,4 +896,6 @@ void Clay_Raylib_Render(Clay_RenderCommandArray renderCommands, Font* fonts,
         }
         }
     }
+
+    if (sdfActive) EndShaderMode();
 }
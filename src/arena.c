@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGNMENT 8 // Enough for every AST struct, chunk headers keep it
+
+static size_t align_up(size_t value) {
+    return (value + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+}
+
+static ArenaChunk *new_chunk(size_t min_capacity) {
+    size_t capacity = min_capacity > ARENA_CHUNK_SIZE ? min_capacity : ARENA_CHUNK_SIZE;
+    ArenaChunk *chunk = malloc(sizeof(ArenaChunk) + capacity);
+    if (!chunk) {
+        perror("Error: arena allocation failed");
+        exit(1);
+    }
+    chunk->next = NULL;
+    chunk->used = 0;
+    chunk->capacity = capacity;
+    return chunk;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+    size = align_up(size ? size : 1);
+
+    ArenaChunk *chunk = arena->head;
+    if (!chunk || chunk->capacity - chunk->used < size) {
+        chunk = new_chunk(size);
+        chunk->next = arena->head;
+        arena->head = chunk;
+    }
+
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+void *arena_alloc_zero(Arena *arena, size_t size) {
+    void *ptr = arena_alloc(arena, size);
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+char *arena_strndup(Arena *arena, const char *text, size_t size) {
+    char *copy = arena_alloc(arena, size + 1);
+    if (size > 0) {
+        memcpy(copy, text, size);
+    }
+    copy[size] = '\0';
+    return copy;
+}
+
+void arena_reset(Arena *arena) {
+    ArenaChunk *head = arena->head;
+    if (!head) {
+        return;
+    }
+
+    // Merge the chunks, the next round most likely needs as much memory as this one
+    if (head->next) {
+        size_t capacity = 0;
+        for (ArenaChunk *chunk = head; chunk; chunk = chunk->next) {
+            capacity += chunk->capacity;
+        }
+        arena_release(arena);
+        arena->head = new_chunk(capacity);
+    }
+    arena->head->used = 0;
+}
+
+void arena_release(Arena *arena) {
+    ArenaChunk *chunk = arena->head;
+    while (chunk) {
+        ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->head = NULL;
+}
@@ -0,0 +1,33 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// ------------------------------
+//  Bump allocator
+// ------------------------------
+
+// Memory is handed out from big chunks and only released all at once, so allocating is a
+// pointer bump and freeing a whole document does not depend on how many nodes it has.
+// Pointers stay valid until the arena is released, chunks never move.
+
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t used;
+    size_t capacity;
+    unsigned char data[];
+} ArenaChunk;
+
+typedef struct {
+    ArenaChunk *head;
+} Arena;
+
+void *arena_alloc(Arena *arena, size_t size);       // Uninitialized memory
+void *arena_alloc_zero(Arena *arena, size_t size);  // Zero filled memory
+char *arena_strndup(Arena *arena, const char *text, size_t size); // NUL terminated copy
+// Makes all the memory available again without returning it, for arenas reused in rounds
+// (e.g. once per frame). A round that fits in the previous one's memory does not allocate.
+void arena_reset(Arena *arena);
+void arena_release(Arena *arena);
+
+#endif // ARENA_H
@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "file.h"
+
+// Fallback loader, used when the file cannot be mapped. Non-regular files (pipes, character
+// devices) have no size up front, so the buffer grows while reading.
+static char* read_file(const char *file_name, size_t *size) {
+    FILE *file = fopen(file_name, "rb"); // Use binary mode for consistent reading
+    if (file == NULL) {
+        fprintf(stderr, "Error: Cannot open file '%s'\n", file_name);
+        return NULL;
+    }
+
+    size_t capacity = 64 * 1024;
+    size_t bytes_read = 0;
+    char *buffer = NULL;
+
+    do {
+        if (buffer == NULL || bytes_read == capacity) {
+            if (buffer != NULL) {
+                capacity *= 2;
+            }
+            // Allocate buffer with error checking (one extra byte for the terminator)
+            char *grown = (char *)realloc(buffer, capacity + 1);
+            if (grown == NULL) {
+                perror("Error: Memory allocation failed");
+                free(buffer);
+                fclose(file);
+                exit(1);
+            }
+            buffer = grown;
+        }
+        bytes_read += fread(buffer + bytes_read, 1, capacity - bytes_read, file);
+    } while (!feof(file) && !ferror(file));
+
+    // Read file content with error checking
+    if (ferror(file)) {
+        perror("Error reading file");
+        free(buffer);
+        fclose(file);
+        return NULL;
+    }
+
+    fclose(file);
+
+    if (bytes_read == 0) {
+        fprintf(stderr, "Error: File '%s' is empty\n", file_name);
+        free(buffer);
+        return NULL;
+    }
+
+    buffer[bytes_read] = '\0';
+
+    *size = bytes_read;
+    return buffer;
+}
+
+// Maps regular files straight into memory, so the parser (and the text nodes that reference
+// the source) work on the page cache without an extra copy. Falls back to read_file().
+bool load_file(const char *file_name, bool allow_mmap, FileContent *content) {
+    *content = (FileContent) {0};
+
+    int fd = open(file_name, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot open file '%s'\n", file_name);
+        return false;
+    }
+
+    struct stat info;
+    if (!allow_mmap || fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+        close(fd);
+        content->data = read_file(file_name, &content->size);
+        return content->data != NULL;
+    }
+
+    if (info.st_size == 0) {
+        fprintf(stderr, "Error: File '%s' is empty\n", file_name);
+        close(fd);
+        return false;
+    }
+
+    void *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // The mapping keeps its own reference to the file
+    if (data == MAP_FAILED) {
+        content->data = read_file(file_name, &content->size);
+        return content->data != NULL;
+    }
+
+    // The parser reads the whole document front to back
+    madvise(data, info.st_size, MADV_SEQUENTIAL);
+
+    content->data = data;
+    content->size = info.st_size;
+    content->is_mapped = true;
+    return true;
+}
+
+void release_file(FileContent *content) {
+    if (content->is_mapped) {
+        munmap(content->data, content->size);
+    } else {
+        free(content->data);
+    }
+    *content = (FileContent) {0};
+}
+
+bool cache_directory(char *path, size_t size, bool create) {
+    const char *base = getenv("XDG_CACHE_HOME");
+    int length;
+    if (base && base[0] == '/') {
+        length = snprintf(path, size, "%s/markdown_visualizer", base);
+    } else {
+        const char *home = getenv("HOME");
+        if (!home || !home[0]) {
+            return false;
+        }
+        length = snprintf(path, size, "%s/.cache/markdown_visualizer", home);
+    }
+    if (length <= 0 || (size_t)length >= size) {
+        return false;
+    }
+
+    if (create) {
+        // ~/.cache may not exist yet
+        char *slash = strrchr(path, '/');
+        if (slash && slash != path) {
+            *slash = '\0';
+            mkdir(path, 0755);
+            *slash = '/';
+        }
+        mkdir(path, 0755);
+    }
+    return true;
+}
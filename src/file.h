@@ -0,0 +1,25 @@
+#ifndef FILE_H
+#define FILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Document contents, either mapped from the file or read into a heap buffer.
+typedef struct {
+    char *data;
+    size_t size;
+    bool is_mapped;
+} FileContent;
+
+// Loads the whole file. Regular files are mapped unless allow_mmap is false: a file that is
+// rewritten in place would change under the mapping (or fault, when truncated).
+// Prints the reason and returns false if the file cannot be loaded.
+bool load_file(const char *file_name, bool allow_mmap, FileContent *content);
+void release_file(FileContent *content);
+
+// Directory for files that only save work, $XDG_CACHE_HOME/markdown_visualizer or
+// ~/.cache/markdown_visualizer. Created along with its parent if create is true. Returns false
+// if there is no place for it.
+bool cache_directory(char *path, size_t size, bool create);
+
+#endif // FILE_H
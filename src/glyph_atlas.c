@@ -0,0 +1,501 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "rlgl.h"
+
+#include "glyph_atlas.h"
+
+#define ATLAS_WIDTH 1024
+#define ATLAS_INITIAL_HEIGHT 128
+#define ATLAS_MAX_HEIGHT 8192
+#define GLYPH_PADDING 4         // same as LoadFontEx(), keeps bilinear filtering inside the glyph
+
+// FreeType allows faces of a single library to be created and destroyed from several threads
+// only under a lock, everything else works per face
+static pthread_mutex_t g_face_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define CACHE_MAGIC "MDVATLAS"
+// Taller atlases are not saved (and an old file is removed), so the next start begins empty
+// instead of loading a big atlas that keeps growing with every document opened
+#define CACHE_MAX_HEIGHT 2048
+#define CACHE_VERSION 2
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    int32_t pixel_size;
+    uint64_t font_hash;
+    int32_t sdf;
+    int32_t ascent;
+    int32_t padding;
+    int32_t glyph_count;
+    int32_t shelf_count;
+    int32_t width;
+    int32_t height;
+} CacheHeader;
+
+typedef struct {
+    int32_t value;
+    int32_t offset_x;
+    int32_t offset_y;
+    int32_t advance_x;
+    Rectangle rec;
+} CachedGlyph;
+
+static void *grow_array(void *array, int *capacity, int needed, size_t item_size) {
+    if (*capacity >= needed) {
+        return array;
+    }
+    int new_capacity = *capacity ? *capacity * 2 : 64;
+    while (new_capacity < needed) {
+        new_capacity *= 2;
+    }
+    array = realloc(array, new_capacity * item_size);
+    if (!array) {
+        printf("Cannot allocate heap memmory");
+        exit(1);
+    }
+    *capacity = new_capacity;
+    return array;
+}
+
+// Transparent white, like the atlases of LoadFontEx(): filtering at glyph edges blends
+// towards transparent instead of towards black
+static void clear_pixels(unsigned char *pixels, int count) {
+    for (int i = 0; i < count; i++) {
+        pixels[i * 2] = 255;
+        pixels[i * 2 + 1] = 0;
+    }
+}
+
+static void upload_atlas(GlyphAtlas *atlas) {
+    atlas->font.texture = LoadTextureFromImage(atlas->atlas);
+    SetTextureFilter(atlas->font.texture, TEXTURE_FILTER_BILINEAR);
+}
+
+static bool grow_atlas(GlyphAtlas *atlas) {
+    int old_height = atlas->atlas.height;
+    if (old_height * 2 > ATLAS_MAX_HEIGHT) {
+        return false;
+    }
+    unsigned char *pixels = realloc(atlas->atlas.data, (size_t)ATLAS_WIDTH * old_height * 2 * 2);
+    if (!pixels) {
+        printf("Cannot allocate heap memmory");
+        exit(1);
+    }
+    clear_pixels(pixels + (size_t)ATLAS_WIDTH * old_height * 2, ATLAS_WIDTH * old_height);
+    atlas->atlas.data = pixels;
+    atlas->atlas.height = old_height * 2;
+
+    // Quads already batched still sample the old texture
+    rlDrawRenderBatchActive();
+    UnloadTexture(atlas->font.texture);
+    upload_atlas(atlas);
+    return true;
+}
+
+// Finds room for a width x height box: the flattest shelf it fits in without wasting more than
+// a quarter of the shelf height, or a new shelf under the last one
+static bool reserve_box(GlyphAtlas *atlas, int width, int height, int *x, int *y) {
+    GlyphShelf *best = NULL;
+    for (int i = 0; i < atlas->shelf_count; i++) {
+        GlyphShelf *shelf = &atlas->shelves[i];
+        if (shelf->height >= height && shelf->height <= height + height / 4
+                && shelf->used + width <= ATLAS_WIDTH
+                && (!best || shelf->height < best->height)) {
+            best = shelf;
+        }
+    }
+
+    if (!best) {
+        int top = 0;
+        if (atlas->shelf_count > 0) {
+            GlyphShelf *last = &atlas->shelves[atlas->shelf_count - 1];
+            top = last->y + last->height;
+        }
+        while (top + height > atlas->atlas.height) {
+            if (!grow_atlas(atlas)) {
+                return false;
+            }
+        }
+        atlas->shelves = grow_array(atlas->shelves, &atlas->shelves_capacity,
+                                    atlas->shelf_count + 1, sizeof(GlyphShelf));
+        best = &atlas->shelves[atlas->shelf_count++];
+        *best = (GlyphShelf) {
+            .y = top,
+            .height = height,
+        };
+    }
+
+    *x = best->used;
+    *y = best->y;
+    best->used += width;
+    return true;
+}
+
+// ---- Atlas cache ----
+// One file per face and pixel size: header, glyph metrics, shelves, then the atlas pixels.
+// Loaded with a single read, written to a temporary file and renamed over the old one so
+// viewers started at the same time never see half a file. The file grows with every glyph
+// used, until the atlas passes CACHE_MAX_HEIGHT and the cache starts over.
+
+static uint64_t hash_bytes(const char *data, size_t size) {
+    uint64_t hash = 1469598103934665603ull; // FNV-1a
+    for (size_t i = 0; i < size; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static bool cache_path(const GlyphAtlas *atlas, char *path, size_t size, bool create) {
+    char directory[PATH_MAX];
+    if (!cache_directory(directory, sizeof(directory), create)) {
+        return false;
+    }
+    int length = snprintf(path, size, "%s/%016llx-%d%s.atlas", directory,
+                          (unsigned long long)atlas->font_hash, atlas->pixel_size,
+                          atlas->sdf ? "-sdf" : "");
+    return length > 0 && (size_t)length < size;
+}
+
+// Glyph boxes and shelves must lie inside the atlas, new glyphs are written where they say
+static bool valid_cache_layout(const CacheHeader *header, const char *cursor) {
+    for (int i = 0; i < header->glyph_count; i++, cursor += sizeof(CachedGlyph)) {
+        CachedGlyph glyph;
+        memcpy(&glyph, cursor, sizeof(glyph));
+        Rectangle rec = glyph.rec;
+        bool empty = rec.x == 0 && rec.y == 0 && rec.width == 0 && rec.height == 0;
+        if (glyph.value < 0 || glyph.value > 0x10FFFF
+                || (!empty && !(rec.x >= 0 && rec.y >= 0 && rec.width > 0 && rec.height > 0
+                                && rec.x + rec.width <= ATLAS_WIDTH
+                                && rec.y + rec.height <= header->height))) {
+            return false;
+        }
+    }
+
+    int bottom = 0;
+    for (int i = 0; i < header->shelf_count; i++, cursor += sizeof(GlyphShelf)) {
+        GlyphShelf shelf;
+        memcpy(&shelf, cursor, sizeof(shelf));
+        if (shelf.y < bottom || shelf.height <= 0 || shelf.height > header->height - shelf.y
+                || shelf.used < 0 || shelf.used > ATLAS_WIDTH) {
+            return false;
+        }
+        bottom = shelf.y + shelf.height;
+    }
+    return true;
+}
+
+static bool load_cache(GlyphAtlas *atlas) {
+    char path[PATH_MAX];
+    if (!cache_path(atlas, path, sizeof(path), false)) {
+        return false;
+    }
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fileno(file), &info) != 0 || (size_t)info.st_size < sizeof(CacheHeader)) {
+        fclose(file);
+        return false;
+    }
+    size_t size = info.st_size;
+    char *data = malloc(size);
+    if (!data) {
+        printf("Cannot allocate heap memmory");
+        exit(1);
+    }
+    bool read = fread(data, 1, size, file) == size;
+    fclose(file);
+
+    CacheHeader header;
+    memcpy(&header, data, sizeof(header));
+    bool valid = read && memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) == 0
+                 && header.version == CACHE_VERSION
+                 && header.font_hash == atlas->font_hash
+                 && header.pixel_size == atlas->pixel_size
+                 && header.sdf == atlas->sdf
+                 && header.ascent == atlas->ascent
+                 && header.padding == GLYPH_PADDING
+                 && header.width == ATLAS_WIDTH
+                 && header.height >= ATLAS_INITIAL_HEIGHT && header.height <= CACHE_MAX_HEIGHT
+                 && header.glyph_count >= 0 && header.glyph_count <= 0x10FFFF
+                 && header.shelf_count >= 0 && header.shelf_count <= header.height;
+    size_t glyphs_size = valid ? header.glyph_count * sizeof(CachedGlyph) : 0;
+    size_t shelves_size = valid ? header.shelf_count * sizeof(GlyphShelf) : 0;
+    size_t pixels_size = valid ? (size_t)header.width * header.height * 2 : 0;
+    if (!valid || size != sizeof(header) + glyphs_size + shelves_size + pixels_size
+            || !valid_cache_layout(&header, data + sizeof(header))) {
+        free(data);
+        return false;
+    }
+
+    const char *cursor = data + sizeof(header);
+    atlas->font.glyphs = grow_array(NULL, &atlas->glyphs_capacity,
+                                    header.glyph_count > 128 ? header.glyph_count : 128,
+                                    sizeof(GlyphInfo));
+    atlas->font.recs = malloc(atlas->glyphs_capacity * sizeof(Rectangle));
+    if (!atlas->font.recs) {
+        printf("Cannot allocate heap memmory");
+        exit(1);
+    }
+    for (int i = 0; i < header.glyph_count; i++, cursor += sizeof(CachedGlyph)) {
+        CachedGlyph glyph;
+        memcpy(&glyph, cursor, sizeof(glyph));
+        atlas->font.glyphs[i] = (GlyphInfo) {
+            .value = glyph.value,
+            .offsetX = glyph.offset_x,
+            .offsetY = glyph.offset_y,
+            .advanceX = glyph.advance_x,
+        };
+        atlas->font.recs[i] = glyph.rec;
+    }
+    atlas->font.glyphCount = header.glyph_count;
+    atlas->saved_glyph_count = header.glyph_count;
+
+    atlas->shelves = grow_array(NULL, &atlas->shelves_capacity, header.shelf_count + 1,
+                                sizeof(GlyphShelf));
+    memcpy(atlas->shelves, cursor, shelves_size);
+    atlas->shelf_count = header.shelf_count;
+    cursor += shelves_size;
+
+    // The pixels are moved to the front, the buffer becomes the atlas image
+    memmove(data, cursor, pixels_size);
+    atlas->atlas = (Image) {
+        .data = realloc(data, pixels_size),
+        .width = header.width,
+        .height = header.height,
+        .mipmaps = 1,
+        .format = PIXELFORMAT_UNCOMPRESSED_GRAY_ALPHA,
+    };
+    if (!atlas->atlas.data) {
+        printf("Cannot allocate heap memmory");
+        exit(1);
+    }
+    return true;
+}
+
+static bool write_all(FILE *file, const void *data, size_t size) {
+    return fwrite(data, 1, size, file) == size;
+}
+
+// Saves the atlas if glyphs were added since it was loaded. Failures only cost a slower start.
+static void save_cache(const GlyphAtlas *atlas) {
+    char path[PATH_MAX];
+    char temporary[PATH_MAX + 32];
+    if (atlas->atlas.height > CACHE_MAX_HEIGHT) {
+        if (cache_path(atlas, path, sizeof(path), false)) {
+            unlink(path);
+        }
+        return;
+    }
+    if (atlas->font.glyphCount == atlas->saved_glyph_count
+            || !cache_path(atlas, path, sizeof(path), true)) {
+        return;
+    }
+
+    snprintf(temporary, sizeof(temporary), "%s.%ld.tmp", path, (long)getpid());
+    FILE *file = fopen(temporary, "wb");
+    if (!file) {
+        return;
+    }
+
+    CacheHeader header = {
+        .version = CACHE_VERSION,
+        .pixel_size = atlas->pixel_size,
+        .font_hash = atlas->font_hash,
+        .sdf = atlas->sdf,
+        .ascent = atlas->ascent,
+        .padding = GLYPH_PADDING,
+        .glyph_count = atlas->font.glyphCount,
+        .shelf_count = atlas->shelf_count,
+        .width = atlas->atlas.width,
+        .height = atlas->atlas.height,
+    };
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+
+    bool written = write_all(file, &header, sizeof(header));
+    for (int i = 0; written && i < atlas->font.glyphCount; i++) {
+        CachedGlyph glyph = {
+            .value = atlas->font.glyphs[i].value,
+            .offset_x = atlas->font.glyphs[i].offsetX,
+            .offset_y = atlas->font.glyphs[i].offsetY,
+            .advance_x = atlas->font.glyphs[i].advanceX,
+            .rec = atlas->font.recs[i],
+        };
+        written = write_all(file, &glyph, sizeof(glyph));
+    }
+    written = written && write_all(file, atlas->shelves, atlas->shelf_count * sizeof(GlyphShelf))
+              && write_all(file, atlas->atlas.data, (size_t)atlas->atlas.width * atlas->atlas.height * 2);
+
+    if (fclose(file) != 0 || !written || rename(temporary, path) != 0) {
+        unlink(temporary);
+    }
+}
+
+// ---- Atlas ----
+
+static void init_empty_atlas(GlyphAtlas *atlas) {
+    atlas->atlas = (Image) {
+        .data = malloc((size_t)ATLAS_WIDTH * ATLAS_INITIAL_HEIGHT * 2),
+        .width = ATLAS_WIDTH,
+        .height = ATLAS_INITIAL_HEIGHT,
+        .mipmaps = 1,
+        .format = PIXELFORMAT_UNCOMPRESSED_GRAY_ALPHA,
+    };
+    if (!atlas->atlas.data) {
+        printf("Cannot allocate heap memmory");
+        exit(1);
+    }
+    clear_pixels(atlas->atlas.data, ATLAS_WIDTH * ATLAS_INITIAL_HEIGHT);
+
+    atlas->font.glyphs = grow_array(NULL, &atlas->glyphs_capacity, 128, sizeof(GlyphInfo));
+    atlas->font.recs = malloc(atlas->glyphs_capacity * sizeof(Rectangle));
+    if (!atlas->font.recs) {
+        printf("Cannot allocate heap memmory");
+        exit(1);
+    }
+}
+
+bool glyph_atlas_load(GlyphAtlas *atlas, FT_Library library, const char *path, int pixel_size,
+                      bool sdf) {
+    *atlas = (GlyphAtlas) {
+        .sdf = sdf,
+    };
+
+    if (!load_file(path, true, &atlas->font_file)) {
+        return false;
+    }
+    atlas->font_hash = hash_bytes(atlas->font_file.data, atlas->font_file.size);
+
+    pthread_mutex_lock(&g_face_mutex);
+    FT_Error error = FT_New_Memory_Face(library, (const FT_Byte *)atlas->font_file.data,
+                                        (FT_Long)atlas->font_file.size, 0, &atlas->face);
+    pthread_mutex_unlock(&g_face_mutex);
+    if (error) {
+        printf("Error: Cannot load font '%s'\n", path);
+        atlas->face = NULL;
+        release_file(&atlas->font_file);
+        return false;
+    }
+
+    // Same scale as stb_truetype in LoadFontEx(): ascender to descender spans the pixel size
+    FT_Size_RequestRec request = {
+        .type = FT_SIZE_REQUEST_TYPE_REAL_DIM,
+        .height = pixel_size * 64,
+    };
+    FT_Request_Size(atlas->face, &request);
+    int line_height = atlas->face->ascender - atlas->face->descender;
+    atlas->ascent = line_height > 0 ? atlas->face->ascender * pixel_size / line_height : pixel_size;
+    atlas->pixel_size = pixel_size;
+
+    atlas->font.baseSize = pixel_size;
+    atlas->font.glyphPadding = GLYPH_PADDING;
+    if (!load_cache(atlas)) {
+        init_empty_atlas(atlas);
+    }
+    return true;
+}
+
+void glyph_atlas_upload(GlyphAtlas *atlas) {
+    upload_atlas(atlas);
+}
+
+int glyph_atlas_add(GlyphAtlas *atlas, int codepoint) {
+    FT_UInt glyph_index = FT_Get_Char_Index(atlas->face, codepoint);
+    if (glyph_index == 0 || FT_Load_Glyph(atlas->face, glyph_index, FT_LOAD_NO_HINTING)) {
+        return -1;
+    }
+    // Glyphs without outline (spaces) only keep their advance. The distance field reaches
+    // a few pixels out of the outline, bitmap_left and bitmap_top account for it.
+    FT_GlyphSlot slot = atlas->face->glyph;
+    FT_Bitmap *bitmap = &slot->bitmap;
+    bool rendered = !FT_Render_Glyph(slot, atlas->sdf ? FT_RENDER_MODE_SDF : FT_RENDER_MODE_NORMAL)
+                    && bitmap->pixel_mode == FT_PIXEL_MODE_GRAY;
+    int width = rendered ? (int)bitmap->width : 0;
+    int height = rendered ? (int)bitmap->rows : 0;
+
+    Rectangle rec = {0};
+    if (width > 0 && height > 0) {
+        int box_width = width + 2 * GLYPH_PADDING;
+        int box_height = height + 2 * GLYPH_PADDING;
+        int x, y;
+        if (!reserve_box(atlas, box_width, box_height, &x, &y)) {
+            printf("Warning: Glyph atlas full, U+%04X not drawn\n", codepoint);
+            return -1;
+        }
+
+        unsigned char *pixels = atlas->atlas.data;
+        for (int row = 0; row < height; row++) {
+            const unsigned char *source = bitmap->buffer + row * bitmap->pitch;
+            unsigned char *target = pixels + ((size_t)(y + GLYPH_PADDING + row) * ATLAS_WIDTH
+                                              + x + GLYPH_PADDING) * 2;
+            for (int column = 0; column < width; column++) {
+                target[column * 2 + 1] = source[column];
+            }
+        }
+
+        // Only the box of the glyph goes to the GPU
+        unsigned char *box = malloc((size_t)box_width * box_height * 2);
+        if (!box) {
+            printf("Cannot allocate heap memmory");
+            exit(1);
+        }
+        for (int row = 0; row < box_height; row++) {
+            memcpy(box + (size_t)row * box_width * 2,
+                   pixels + ((size_t)(y + row) * ATLAS_WIDTH + x) * 2, (size_t)box_width * 2);
+        }
+        UpdateTextureRec(atlas->font.texture, (Rectangle) {
+            x, y, box_width, box_height
+        }, box);
+        free(box);
+
+        rec = (Rectangle) {
+            x + GLYPH_PADDING, y + GLYPH_PADDING, width, height
+        };
+    }
+
+    int count = atlas->font.glyphCount;
+    int capacity = atlas->glyphs_capacity;
+    atlas->font.glyphs = grow_array(atlas->font.glyphs, &atlas->glyphs_capacity,
+                                    count + 1, sizeof(GlyphInfo));
+    atlas->font.recs = grow_array(atlas->font.recs, &capacity, count + 1, sizeof(Rectangle));
+
+    // Metrics truncated to whole pixels, as LoadFontEx() does
+    atlas->font.glyphs[count] = (GlyphInfo) {
+        .value = codepoint,
+        .offsetX = slot->bitmap_left,
+        .offsetY = atlas->ascent - slot->bitmap_top,
+        .advanceX = (int)(slot->linearHoriAdvance >> 16),
+    };
+    atlas->font.recs[count] = rec;
+    atlas->font.glyphCount = count + 1;
+    return count;
+}
+
+void glyph_atlas_close(GlyphAtlas *atlas) {
+    if (atlas->atlas.data) {
+        save_cache(atlas);
+    }
+    if (atlas->face) {
+        pthread_mutex_lock(&g_face_mutex);
+        FT_Done_Face(atlas->face);
+        pthread_mutex_unlock(&g_face_mutex);
+    }
+    release_file(&atlas->font_file);
+    if (atlas->font.texture.id) {
+        UnloadTexture(atlas->font.texture);
+    }
+    free(atlas->atlas.data);
+    free(atlas->font.glyphs);
+    free(atlas->font.recs);
+    free(atlas->shelves);
+    *atlas = (GlyphAtlas) {0};
+}
@@ -0,0 +1,55 @@
+#ifndef GLYPH_ATLAS_H
+#define GLYPH_ATLAS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "raylib.h"
+#include "file.h"
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+typedef struct {
+    int y;
+    int height;
+    int used;       // width taken from the left
+} GlyphShelf;
+
+// Glyphs of a face rasterized on first use and shelf-packed into a texture that grows with the
+// text. The raylib Font holds the glyphs added so far, laid out the way LoadFontEx() does, so
+// it is measured and drawn as usual. Adding a glyph may move its arrays and replace its texture.
+//
+// Distance field atlases store the signed distance to the glyph edge instead of its coverage
+// (edge at alpha 0.5) and are drawn with a shader, so they scale to any size.
+//
+// The atlas is saved to the user cache directory when it is closed, keyed by the hash of the
+// font file, the pixel size and the kind of atlas. The next launch starts from the glyphs
+// baked so far.
+typedef struct {
+    FT_Face face;
+    FileContent font_file;  // the face reads from it, kept until the atlas is closed
+    uint64_t font_hash;
+    int pixel_size;
+    bool sdf;
+    int saved_glyph_count;  // glyphs already in the cache file
+    Font font;
+    int glyphs_capacity;
+    int ascent;             // baseline, from the top of the line
+    Image atlas;            // CPU copy of the texture
+    GlyphShelf *shelves;
+    int shelf_count;
+    int shelves_capacity;
+} GlyphAtlas;
+
+// Opens the face and loads the cached atlas, reading the font file once. Safe to call from
+// worker threads sharing the library. Prints the reason and returns false on failure.
+bool glyph_atlas_load(GlyphAtlas *atlas, FT_Library library, const char *path, int pixel_size,
+                      bool sdf);
+// Creates the texture of a loaded atlas. Main thread only, like glyph_atlas_add().
+void glyph_atlas_upload(GlyphAtlas *atlas);
+// Index of the new glyph in atlas->font, -1 if the face does not have the codepoint.
+int glyph_atlas_add(GlyphAtlas *atlas, int codepoint);
+void glyph_atlas_close(GlyphAtlas *atlas);
+
+#endif // GLYPH_ATLAS_H
@@ -0,0 +1,598 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "image_loader.h"
+
+#define IMAGE_LOADER_MAX_THREADS 8
+
+// Positions of the ids that are not in the queue
+#define JOB_NOT_QUEUED -1
+#define JOB_IN_FLIGHT -2    // being decoded, or waiting for image_loader_poll()
+
+static void *grow_array(void *array, int *capacity, int needed, size_t item_size) {
+    if (*capacity >= needed) {
+        return array;
+    }
+    int new_capacity = *capacity ? *capacity * 2 : 64;
+    while (new_capacity < needed) {
+        new_capacity *= 2;
+    }
+    array = realloc(array, new_capacity * item_size);
+    if (!array) {
+        printf("Cannot allocate heap memmory");
+        exit(1);
+    }
+    *capacity = new_capacity;
+    return array;
+}
+
+// ---- Queue (binary heap, the loader mutex must be held) -----
+
+static void place_job(ImageLoader *loader, int position, ImageJob job) {
+    loader->queue[position] = job;
+    loader->positions[job.id] = position;
+}
+
+static void sift_up(ImageLoader *loader, int position) {
+    ImageJob job = loader->queue[position];
+    while (position > 0) {
+        int parent = (position - 1) / 2;
+        if (loader->queue[parent].distance <= job.distance) {
+            break;
+        }
+        place_job(loader, position, loader->queue[parent]);
+        position = parent;
+    }
+    place_job(loader, position, job);
+}
+
+static void sift_down(ImageLoader *loader, int position) {
+    ImageJob job = loader->queue[position];
+    for (;;) {
+        int child = position * 2 + 1;
+        if (child >= loader->queue_count) {
+            break;
+        }
+        if (child + 1 < loader->queue_count
+                && loader->queue[child + 1].distance < loader->queue[child].distance) {
+            child++;
+        }
+        if (job.distance <= loader->queue[child].distance) {
+            break;
+        }
+        place_job(loader, position, loader->queue[child]);
+        position = child;
+    }
+    place_job(loader, position, job);
+}
+
+static ImageJob remove_job(ImageLoader *loader, int position) {
+    ImageJob job = loader->queue[position];
+    loader->positions[job.id] = JOB_IN_FLIGHT;
+
+    loader->queue_count--;
+    if (position < loader->queue_count) {
+        ImageJob last = loader->queue[loader->queue_count];
+        place_job(loader, position, last);
+        sift_up(loader, position);
+        sift_down(loader, loader->positions[last.id]);
+    }
+    return job;
+}
+
+// ---- Completion list (lock-free) -----
+
+// Any thread. The release pairs with the acquire of take_completed(), so the pixels written
+// by the worker are visible to the main thread on weakly ordered CPUs too.
+static void push_completed(ImageLoader *loader, DecodedImage decoded) {
+    CompletedImage *node = malloc(sizeof(CompletedImage));
+    if (!node) {
+        printf("Cannot allocate heap memmory");
+        exit(1);
+    }
+    node->decoded = decoded;
+
+    CompletedImage *head = __atomic_load_n(&loader->completed, __ATOMIC_RELAXED);
+    do {
+        node->next = head;
+    } while (!__atomic_compare_exchange_n(&loader->completed, &head, node, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Main thread. Moves everything pushed so far to the ready list, oldest first.
+static void take_completed(ImageLoader *loader) {
+    if (!__atomic_load_n(&loader->completed, __ATOMIC_RELAXED)) {
+        return;
+    }
+    CompletedImage *list = __atomic_exchange_n(&loader->completed, NULL, __ATOMIC_ACQUIRE);
+
+    CompletedImage *ordered = NULL;
+    while (list) {
+        CompletedImage *next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+    }
+
+    // Anything still ready came before them
+    CompletedImage **tail = &loader->ready;
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    *tail = ordered;
+}
+
+static void free_completed(CompletedImage *list) {
+    while (list) {
+        CompletedImage *next = list->next;
+        image_loader_release(&list->decoded);
+        free(list);
+        list = next;
+    }
+}
+
+// ---- Decoded image cache -----
+
+// Pixels of a decoded image, uncompressed, right after the header. Named after the key, so a
+// changed image file (or a different width) just misses. Images that did not need scaling
+// down are keyed with width 0, one entry for every width they fit in. Written to a temporary
+// file and renamed, so workers and other viewers never map half a file.
+//
+// Missed entries are never read again, so the cache is kept under IMAGE_CACHE_MAX_SIZE by
+// removing the least recently used files after every save. Hits touch their file, so the
+// modification time is the last use. Temporary files left by a crash go at the same time.
+
+#define IMAGE_CACHE_MAGIC "MDVIMAGE"
+#define IMAGE_CACHE_VERSION 1
+#define IMAGE_CACHE_MAX_SIZE ((off_t)512 << 20)
+#define IMAGE_CACHE_TEMPORARY_AGE 3600 // seconds, no save takes that long
+
+// Workers saving at the same time would prune the same files
+static pthread_mutex_t g_prune_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct {
+    char magic[8];
+    int32_t version;
+    int32_t width;
+    int32_t height;
+    int32_t format;
+    int32_t source_width;
+    int32_t source_height;
+    uint64_t key;
+} ImageCacheHeader;
+
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t size) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull; // FNV-1a
+    }
+    return hash;
+}
+
+// The same image referenced from different documents (or relative paths) shares the entry
+static uint64_t image_cache_key(const char *path, const struct stat *info, int max_width) {
+    char absolute[PATH_MAX];
+    if (realpath(path, absolute)) {
+        path = absolute;
+    }
+    int64_t stamp[4] = { info->st_mtim.tv_sec, info->st_mtim.tv_nsec, info->st_size, max_width };
+    uint64_t hash = hash_bytes(1469598103934665603ull, path, strlen(path));
+    return hash_bytes(hash, stamp, sizeof(stamp));
+}
+
+static bool image_cache_path(uint64_t key, char *path, size_t size, bool create) {
+    char directory[PATH_MAX];
+    if (!cache_directory(directory, sizeof(directory), create)) {
+        return false;
+    }
+    int length = snprintf(path, size, "%s/%016llx.image", directory, (unsigned long long)key);
+    return length > 0 && (size_t)length < size;
+}
+
+static bool load_cached_image(uint64_t key, DecodedImage *decoded) {
+    char path[PATH_MAX];
+    if (!image_cache_path(key, path, sizeof(path), false)) {
+        return false;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(ImageCacheHeader)) {
+        close(fd);
+        return false;
+    }
+    void *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    futimens(fd, NULL); // used now, pruned last
+    close(fd); // The mapping keeps its own reference to the file
+
+    ImageCacheHeader header;
+    memcpy(&header, data, sizeof(header));
+    bool valid = memcmp(header.magic, IMAGE_CACHE_MAGIC, sizeof(header.magic)) == 0
+                 && header.version == IMAGE_CACHE_VERSION && header.key == key
+                 && header.width > 0 && header.height > 0
+                 && header.format > 0 && header.format < PIXELFORMAT_COMPRESSED_DXT1_RGB
+                 && (size_t)info.st_size == sizeof(header)
+                    + (size_t)GetPixelDataSize(header.width, header.height, header.format);
+    if (!valid) {
+        munmap(data, info.st_size);
+        return false;
+    }
+
+    // The texture upload reads all of it soon
+    madvise(data, info.st_size, MADV_WILLNEED);
+
+    decoded->cached = (FileContent) {
+        .data = data,
+        .size = info.st_size,
+        .is_mapped = true,
+    };
+    decoded->image = (Image) {
+        .data = (char*)data + sizeof(header),
+        .width = header.width,
+        .height = header.height,
+        .mipmaps = 1,
+        .format = header.format,
+    };
+    decoded->source_width = header.source_width;
+    decoded->source_height = header.source_height;
+    return true;
+}
+
+typedef struct {
+    char name[32];
+    off_t size;
+    struct timespec used;
+} CacheEntry;
+
+static int compare_entry_use(const void *a, const void *b) {
+    const struct timespec *used_a = &((const CacheEntry*)a)->used;
+    const struct timespec *used_b = &((const CacheEntry*)b)->used;
+    if (used_a->tv_sec != used_b->tv_sec) {
+        return used_a->tv_sec < used_b->tv_sec ? -1 : 1;
+    }
+    return used_a->tv_nsec < used_b->tv_nsec ? -1 : used_a->tv_nsec > used_b->tv_nsec;
+}
+
+static bool has_suffix(const char *name, size_t length, const char *suffix) {
+    size_t suffix_length = strlen(suffix);
+    return length >= suffix_length && strcmp(name + length - suffix_length, suffix) == 0;
+}
+
+// Removes the least recently used images until the cache fits in IMAGE_CACHE_MAX_SIZE, and the
+// temporary files of saves that never finished
+static void prune_image_cache(void) {
+    char directory[PATH_MAX];
+    if (!cache_directory(directory, sizeof(directory), false)) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_prune_mutex);
+    DIR *dir = opendir(directory);
+    if (!dir) {
+        pthread_mutex_unlock(&g_prune_mutex);
+        return;
+    }
+
+    CacheEntry *entries = NULL;
+    int count = 0;
+    int capacity = 0;
+    off_t total = 0;
+    time_t now = time(NULL);
+    struct dirent *file;
+    while ((file = readdir(dir))) {
+        size_t length = strlen(file->d_name);
+        struct stat info;
+        if (has_suffix(file->d_name, length, ".tmp")
+                && fstatat(dirfd(dir), file->d_name, &info, 0) == 0
+                && now - info.st_mtim.tv_sec > IMAGE_CACHE_TEMPORARY_AGE) {
+            unlinkat(dirfd(dir), file->d_name, 0);
+            continue;
+        }
+        if (length >= sizeof(entries->name) || !has_suffix(file->d_name, length, ".image")
+                || fstatat(dirfd(dir), file->d_name, &info, 0) != 0) {
+            continue;
+        }
+        entries = grow_array(entries, &capacity, count + 1, sizeof(CacheEntry));
+        memcpy(entries[count].name, file->d_name, length + 1);
+        entries[count].size = info.st_size;
+        entries[count].used = info.st_mtim;
+        total += info.st_size;
+        count++;
+    }
+
+    if (total > IMAGE_CACHE_MAX_SIZE) {
+        qsort(entries, count, sizeof(CacheEntry), compare_entry_use);
+        for (int i = 0; i < count && total > IMAGE_CACHE_MAX_SIZE; i++) {
+            if (unlinkat(dirfd(dir), entries[i].name, 0) == 0) {
+                total -= entries[i].size;
+            }
+        }
+    }
+
+    closedir(dir);
+    pthread_mutex_unlock(&g_prune_mutex);
+    free(entries);
+}
+
+// Failures only cost decoding the image again next time
+static void save_cached_image(uint64_t key, const DecodedImage *decoded) {
+    char path[PATH_MAX];
+    char temporary[PATH_MAX + 48];
+    if (!image_cache_path(key, path, sizeof(path), true)) {
+        return;
+    }
+    snprintf(temporary, sizeof(temporary), "%s.%ld.%lx.tmp", path, (long)getpid(),
+             (unsigned long)pthread_self());
+    FILE *file = fopen(temporary, "wb");
+    if (!file) {
+        return;
+    }
+
+    const Image *image = &decoded->image;
+    ImageCacheHeader header = {
+        .version = IMAGE_CACHE_VERSION,
+        .width = image->width,
+        .height = image->height,
+        .format = image->format,
+        .source_width = decoded->source_width,
+        .source_height = decoded->source_height,
+        .key = key,
+    };
+    memcpy(header.magic, IMAGE_CACHE_MAGIC, sizeof(header.magic));
+
+    size_t size = GetPixelDataSize(image->width, image->height, image->format);
+    bool written = fwrite(&header, 1, sizeof(header), file) == sizeof(header)
+                   && fwrite(image->data, 1, size, file) == size;
+    if (fclose(file) != 0 || !written || rename(temporary, path) != 0) {
+        unlink(temporary);
+        return;
+    }
+    prune_image_cache();
+}
+
+// ---- Workers -----
+
+static DecodedImage decode_image(const ImageJob *job) {
+    DecodedImage decoded = { .id = job->id };
+    struct stat info;
+    if (stat(job->path, &info) != 0) {
+        printf("Cannot load image: '%s'\n", job->path);
+        return decoded;
+    }
+
+    uint64_t key = image_cache_key(job->path, &info, job->max_width);
+    if (load_cached_image(key, &decoded)) {
+        printf("Loaded image (cached): '%s'\n", job->path);
+        return decoded;
+    }
+    uint64_t unscaled_key = image_cache_key(job->path, &info, 0);
+    if (load_cached_image(unscaled_key, &decoded)) {
+        if (job->max_width <= 0 || decoded.image.width <= job->max_width) {
+            printf("Loaded image (cached): '%s'\n", job->path);
+            return decoded;
+        }
+        image_loader_release(&decoded); // Wider now, scaled below
+        decoded = (DecodedImage) { .id = job->id };
+    }
+
+    Image image = LoadImage(job->path);
+    if (!image.data) {
+        printf("Cannot load image (LoadImage failed): '%s'\n", job->path);
+        return decoded;
+    }
+    printf("Loaded image: '%s'\n", job->path);
+
+    decoded.source_width = image.width;
+    decoded.source_height = image.height;
+
+    // Compressed images are not scaled, and are cheap to load anyway
+    if (image.format < PIXELFORMAT_COMPRESSED_DXT1_RGB) {
+        bool scaled = image.width > job->max_width && job->max_width > 0;
+        if (scaled) {
+            int height = (int)((long long)image.height * job->max_width / image.width);
+            ImageResize(&image, job->max_width, height > 0 ? height : 1);
+        }
+        decoded.image = image;
+        save_cached_image(scaled ? key : unscaled_key, &decoded);
+    }
+
+    decoded.image = image;
+    return decoded;
+}
+
+static void *image_worker(void *arg) {
+    ImageLoader *loader = arg;
+
+    pthread_mutex_lock(&loader->mutex);
+    for (;;) {
+        while (!loader->stopping && loader->queue_count == 0) {
+            pthread_cond_wait(&loader->wake, &loader->mutex);
+        }
+        if (loader->stopping) {
+            break;
+        }
+
+        ImageJob job = remove_job(loader, 0);
+        pthread_mutex_unlock(&loader->mutex);
+
+        push_completed(loader, decode_image(&job));
+
+        pthread_mutex_lock(&loader->mutex);
+    }
+    pthread_mutex_unlock(&loader->mutex);
+
+    return NULL;
+}
+
+// One worker per core: decoding is CPU bound, and the render thread has little to do while
+// images come in.
+static void start_workers(ImageLoader *loader) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int count = cores < 1 ? 1 : (cores > IMAGE_LOADER_MAX_THREADS ? IMAGE_LOADER_MAX_THREADS :
+                                 (int)cores);
+
+    pthread_mutex_init(&loader->mutex, NULL);
+    pthread_cond_init(&loader->wake, NULL);
+    loader->threads = malloc(count * sizeof(pthread_t));
+    if (!loader->threads) {
+        printf("Cannot allocate heap memmory");
+        exit(1);
+    }
+
+    for (int i = 0; i < count; i++) {
+        int ret_val = pthread_create(&loader->threads[i], NULL, image_worker, loader);
+        if (ret_val != 0) {
+            fprintf(stderr, "Error creating thread: %d\n", ret_val);
+            exit(1);
+        }
+        loader->thread_count++;
+    }
+}
+
+// ---- API -----
+
+void image_loader_request(ImageLoader *loader, int id, const char *path, float distance,
+                          unsigned frame, int max_width) {
+    if (!loader->threads) {
+        start_workers(loader);
+    }
+
+    pthread_mutex_lock(&loader->mutex);
+
+    if (id >= loader->positions_capacity) {
+        int old_capacity = loader->positions_capacity;
+        loader->positions = grow_array(loader->positions, &loader->positions_capacity, id + 1,
+                                       sizeof(int));
+        for (int i = old_capacity; i < loader->positions_capacity; i++) {
+            loader->positions[i] = JOB_NOT_QUEUED;
+        }
+    }
+
+    int position = loader->positions[id];
+    if (position == JOB_IN_FLIGHT) {
+        // Asked again before the result was picked up
+    } else if (position >= 0) {
+        float previous = loader->queue[position].distance;
+        loader->queue[position].distance = distance;
+        loader->queue[position].frame = frame;
+        loader->queue[position].max_width = max_width;
+        if (distance < previous) {
+            sift_up(loader, position);
+        } else {
+            sift_down(loader, position);
+        }
+    } else {
+        loader->queue = grow_array(loader->queue, &loader->queue_capacity,
+                                   loader->queue_count + 1, sizeof(ImageJob));
+        place_job(loader, loader->queue_count++, (ImageJob) {
+            .id = id, .path = path, .distance = distance, .frame = frame,
+            .max_width = max_width
+        });
+        sift_up(loader, loader->queue_count - 1);
+        pthread_cond_signal(&loader->wake);
+    }
+
+    pthread_mutex_unlock(&loader->mutex);
+}
+
+void image_loader_cancel_stale(ImageLoader *loader, unsigned frame) {
+    if (!loader->threads) {
+        return;
+    }
+
+    pthread_mutex_lock(&loader->mutex);
+    int kept = 0;
+    for (int i = 0; i < loader->queue_count; i++) {
+        ImageJob job = loader->queue[i];
+        if (job.frame == frame) {
+            place_job(loader, kept++, job);
+        } else {
+            loader->positions[job.id] = JOB_IN_FLIGHT;
+            push_completed(loader, (DecodedImage) { .id = job.id, .cancelled = true });
+        }
+    }
+
+    // Removing keeps the order of the rest, but not the heap, so rebuild it
+    loader->queue_count = kept;
+    for (int i = kept / 2 - 1; i >= 0; i--) {
+        sift_down(loader, i);
+    }
+    pthread_mutex_unlock(&loader->mutex);
+}
+
+int image_loader_poll(ImageLoader *loader, DecodedImage *out, int max) {
+    if (!loader->threads) {
+        return 0;
+    }
+
+    take_completed(loader);
+    int count = 0;
+    while (loader->ready && count < max) {
+        CompletedImage *node = loader->ready;
+        loader->ready = node->next;
+        out[count++] = node->decoded;
+        free(node);
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    // They may be requested again
+    pthread_mutex_lock(&loader->mutex);
+    for (int i = 0; i < count; i++) {
+        loader->positions[out[i].id] = JOB_NOT_QUEUED;
+    }
+    pthread_mutex_unlock(&loader->mutex);
+
+    return count;
+}
+
+void image_loader_release(DecodedImage *decoded) {
+    if (decoded->cached.data) {
+        release_file(&decoded->cached);
+    } else if (decoded->image.data) {
+        UnloadImage(decoded->image);
+    }
+    decoded->image = (Image) {0};
+}
+
+void image_loader_stop(ImageLoader *loader) {
+    if (!loader->threads) {
+        return;
+    }
+
+    pthread_mutex_lock(&loader->mutex);
+    loader->stopping = true;
+    pthread_cond_broadcast(&loader->wake);
+    pthread_mutex_unlock(&loader->mutex);
+
+    for (int i = 0; i < loader->thread_count; i++) {
+        pthread_join(loader->threads[i], NULL);
+    }
+
+    take_completed(loader);
+    free_completed(loader->ready);
+
+    pthread_mutex_destroy(&loader->mutex);
+    pthread_cond_destroy(&loader->wake);
+    free(loader->threads);
+    free(loader->queue);
+    free(loader->positions);
+    *loader = (ImageLoader) {0};
+}
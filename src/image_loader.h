@@ -0,0 +1,76 @@
+#ifndef IMAGE_LOADER_H
+#define IMAGE_LOADER_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "raylib.h"
+#include "file.h"
+
+// Decodes images on a fixed pool of worker threads. Queued requests are served nearest to the
+// viewport first, and the ones a layout did not ask for again are dropped before they start.
+// Images are identified by the caller's ids (small non-negative integers).
+//
+// Images wider than they are displayed are scaled down on the worker. The result is saved to
+// the user cache directory, keyed by the image file (path, modification time and size) and the
+// width, and mapped from there the next time instead of decoding the file again.
+
+typedef struct {
+    int id;
+    const char *path;   // owned by the caller, must outlive the request
+    float distance;     // from the viewport, in pixels. Lower goes first
+    unsigned frame;     // layout that asked for it last
+    int max_width;      // scaled down to this width if wider
+} ImageJob;
+
+typedef struct {
+    int id;
+    bool cancelled;     // dropped from the queue, may be asked for again
+    Image image;        // no data if it could not be decoded
+    int source_width;   // size of the image file, before scaling it down
+    int source_height;
+    FileContent cached; // mapped cache file the pixels point into, if they come from it
+} DecodedImage;
+
+typedef struct CompletedImage {
+    struct CompletedImage *next;
+    DecodedImage decoded;
+} CompletedImage;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+    pthread_t *threads;
+    int thread_count;
+    bool stopping;
+
+    ImageJob *queue;    // binary heap on distance
+    int queue_count;
+    int queue_capacity;
+    int *positions;     // heap position of each id, negative when not queued
+    int positions_capacity;
+
+    // Finished (or cancelled) images, pushed without the lock. The producers prepend them,
+    // and the main thread takes the whole list at once and keeps it in completion order in
+    // ready until they are polled.
+    CompletedImage *completed;  // atomic
+    CompletedImage *ready;
+} ImageLoader;
+
+// Queues the image, or updates its distance and width if it is already queued. Ids being
+// decoded, or whose result was not polled yet, are left alone. Workers start on the first
+// request.
+void image_loader_request(ImageLoader *loader, int id, const char *path, float distance,
+                          unsigned frame, int max_width);
+// Drops the queued requests that were not renewed by the given layout. They come back from
+// image_loader_poll() as cancelled.
+void image_loader_cancel_stale(ImageLoader *loader, unsigned frame);
+// Moves up to max finished (or cancelled) images to out and returns how many. Main thread
+// only, it takes the lock just when there is something to return.
+int image_loader_poll(ImageLoader *loader, DecodedImage *out, int max);
+// Frees the pixels of a decoded image, once they are in a texture.
+void image_loader_release(DecodedImage *decoded);
+// Waits for the images being decoded and frees everything left.
+void image_loader_stop(ImageLoader *loader);
+
+#endif // IMAGE_LOADER_H
@@ -1,7 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 
+#include "file.h"
 #include "parser.h"
 #include "render.h"
 
@@ -9,82 +11,26 @@
 
 // Global debug flag
 static int debug_mode = 0;
+static bool watch_mode = false;
 
 void print_usage(const char *program_name) {
     printf("Usage: %s [OPTIONS] <filename.md>\n", program_name);
     printf("Options:\n");
     printf("  --debug    Print AST tree for debugging\n");
+    printf("  --watch    Reload the document when the file changes\n");
+    printf("  --texture-budget <MB>  GPU memory for images before off-screen ones are unloaded\n");
     printf("  --help     Show this help message\n");
     printf("  --version  Show version information\n");
     printf("\nExamples:\n");
     printf("  %s document.md\n", program_name);
     printf("  %s --debug document.md\n", program_name);
+    printf("  %s --watch document.md\n", program_name);
 }
 
 void print_version() {
     printf("Markdown Visualizer v%s\n", VERSION);
 }
 
-char* read_file(const char *file_name) {
-    // Check file extension
-    const char *ext = strrchr(file_name, '.');
-    if (ext == NULL || strcmp(ext, ".md") != 0) {
-        fprintf(stderr, "Warning: File '%s' doesn't have .md extension\n", file_name);
-    }
-
-    FILE *file = fopen(file_name, "rb"); // Use binary mode for consistent reading
-    if (file == NULL) {
-        fprintf(stderr, "Error: Cannot open file '%s'\n", file_name);
-        exit(1);
-    }
-
-    // Determine file size more reliably
-    if (fseek(file, 0, SEEK_END) != 0) {
-        perror("Error seeking file");
-        fclose(file);
-        exit(1);
-    }
-
-    long file_size = ftell(file);
-    if (file_size < 0) {
-        perror("Error getting file size");
-        fclose(file);
-        exit(1);
-    }
-
-    if (file_size == 0) {
-        fprintf(stderr, "Error: File '%s' is empty\n", file_name);
-        fclose(file);
-        exit(1);
-    }
-
-    rewind(file);
-
-    // Allocate buffer with error checking
-    char *buffer = (char *)malloc(file_size + 1);
-    if (buffer == NULL) {
-        perror("Error: Memory allocation failed");
-        fclose(file);
-        exit(1);
-    }
-
-    // Read file content with error checking
-    size_t bytes_read = fread(buffer, 1, file_size, file);
-    if (bytes_read != (size_t)file_size) {
-        if (ferror(file)) {
-            perror("Error reading file");
-            free(buffer);
-            fclose(file);
-            exit(1);
-        }
-    }
-
-    fclose(file);
-    buffer[bytes_read] = '\0';
-
-    return buffer;
-}
-
 int main(int argc, char *argv[]) {
     const char *filename = NULL;
 
@@ -92,6 +38,18 @@ int main(int argc, char *argv[]) {
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "--debug") == 0) {
             debug_mode = 1;
+        } else if (strcmp(argv[i], "--watch") == 0) {
+            watch_mode = true;
+        } else if (strcmp(argv[i], "--texture-budget") == 0) {
+            char *end = NULL;
+            long megabytes = i + 1 < argc ? strtol(argv[i + 1], &end, 10) : 0;
+            if (!end || *end != '\0' || megabytes <= 0) {
+                fprintf(stderr, "Error: --texture-budget needs a size in megabytes\n");
+                print_usage(argv[0]);
+                return 1;
+            }
+            set_texture_budget((size_t)megabytes);
+            i++;
         } else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
             print_usage(argv[0]);
             return 0;
@@ -119,8 +77,18 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    // Read and parse markdown
-    char *file_content = read_file(filename);
+    // Check file extension
+    const char *ext = strrchr(filename, '.');
+    if (ext == NULL || strcmp(ext, ".md") != 0) {
+        fprintf(stderr, "Warning: File '%s' doesn't have .md extension\n", filename);
+    }
+
+    // Read and parse markdown. A watched file is being edited, and editors may rewrite it in
+    // place, so it is copied instead of mapped.
+    FileContent file_content;
+    if (!load_file(filename, !watch_mode, &file_content)) {
+        return 1;
+    }
 
     // Performance: measure parsing time if in debug mode
     if (debug_mode) {
@@ -128,21 +96,36 @@ int main(int argc, char *argv[]) {
         printf("Parsing file: %s\n", filename);
     }
 
-    parse_markdown(file_content);
+    // The viewer parses the document in the background, so the window shows up right away.
+    // Debug mode needs the whole tree up front to print it.
+    MarkdownDocument *document = debug_mode
+                                 ? parse_markdown(file_content.data, file_content.size)
+                                 : begin_document(file_content.data, file_content.size);
+    if (document == NULL) {
+        fprintf(stderr, "Error: Cannot parse file '%s'\n", filename);
+        release_file(&file_content);
+        return 1;
+    }
 
     // Print AST tree if debug mode is enabled
     if (debug_mode) {
         printf("\n=== AST TREE ===\n");
-        print_tree(get_root_node(), 0);
+        print_tree(&document->tree, NODE_ROOT, 0);
         printf("================\n\n");
     }
 
     // Initialize and run the renderer
-    initialize_application(argv[0]);
-
-    // Cleanup
-    free(file_content);
-    free_tree(get_root_node());
+    ViewerDocument viewer_document = {
+        .file_name = filename,
+        .file = file_content,
+        .document = document,
+        .watch = watch_mode,
+    };
+    initialize_application(argv[0], &viewer_document);
+
+    // Cleanup (the viewer may have reloaded both)
+    free_document(viewer_document.document);
+    release_file(&viewer_document.file);
 
     return 0;
 }
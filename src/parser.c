@@ -2,252 +2,850 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <strings.h>
+#include <ctype.h>
 #include "parser.h"
 #include "md4c.h"
 
 #define MD4C_USE_UTF8
 
-static MarkdownNode *root_node = NULL;
-static MarkdownNode *current_node = NULL;
+#define INITIAL_TREE_CAPACITY 1024
+#define CHUNK_MIN_SIZE (16 * 1024) // a reparse costs at least one chunk, keep md4c calls few
 
-static bool parsing_code_block = false;
-static MarkdownNode *accumulated_text_node = NULL;
+// -------------------------------
+//  Node creation
+// -------------------------------
 
-static void start_text_accumulation(void) {
-    parsing_code_block = true;
+static void ensure_tree_capacity(MarkdownTree *tree, uint32_t needed) {
+    if (tree->capacity >= needed) {
+        return;
+    }
+
+    uint32_t new_capacity = tree->capacity ? tree->capacity * 2 : INITIAL_TREE_CAPACITY;
+    while (new_capacity < needed) {
+        new_capacity *= 2;
+    }
 
-    accumulated_text_node = malloc(sizeof(MarkdownNode));
-    if (!accumulated_text_node) {
+    tree->types = realloc(tree->types, new_capacity * sizeof(NodeType));
+    tree->links = realloc(tree->links, new_capacity * sizeof(NodeLinks));
+    tree->values = realloc(tree->values, new_capacity * sizeof(NodeValue));
+    if (!tree->types || !tree->links || !tree->values) {
+        printf("Cannot allocate heap memmory");
         exit(1);
     }
+    tree->capacity = new_capacity;
+}
 
-    accumulated_text_node->type = NODE_TEXT;
-    accumulated_text_node->value.text.type = MD_TEXT_NORMAL;
-    accumulated_text_node->value.text.text = NULL;
-    accumulated_text_node->value.text.size = 0;
+static NodeIndex should_create_node(MarkdownTree *tree, NodeType type) {
+    ensure_tree_capacity(tree, tree->count + 1);
 
-    // ensure clean linkage
-    accumulated_text_node->parent = NULL;
-    accumulated_text_node->first_child = NULL;
-    accumulated_text_node->next_sibling = NULL;
+    NodeIndex node = tree->count++;
+    tree->types[node] = type;
+    tree->links[node] = (NodeLinks) {
+        .parent = NODE_NONE,
+        .first_child = NODE_NONE,
+        .last_child = NODE_NONE,
+        .next_sibling = NODE_NONE,
+    };
+    memset(&tree->values[node], 0, sizeof(NodeValue));
+    return node;
 }
 
-// NOTE: No need to manually append a null terminator; Clay handles both during rendering.
-static void accumulate_text(const MD_CHAR *text, MD_SIZE size) {
-    // old_size stores the stored buffer size
-    MD_SIZE old_size = accumulated_text_node->value.text.size;
-    MD_SIZE old_len  = (old_size > 0) ? old_size: 0;
+static void insert_child_node(MarkdownTree *tree, NodeIndex parent, NodeIndex child) {
+    if (parent == NODE_NONE || child == NODE_NONE) return;
+    NodeLinks *parent_links = &tree->links[parent];
+    tree->links[child].parent = parent;
+    if (parent_links->first_child == NODE_NONE) {
+        parent_links->first_child = child;
+    } else {
+        tree->links[parent_links->last_child].next_sibling = child;
+    }
+    parent_links->last_child = child;
+}
 
-    MD_SIZE new_len  = old_len + size;
-    MD_SIZE new_size = new_len;
+// -------------------------------
+//  Code blocks text
+// -------------------------------
 
-    MD_CHAR *old_text = accumulated_text_node->value.text.text;
-    MD_CHAR *new_text = malloc(sizeof(MD_CHAR) * new_size);
+static void *grow_buffer(void *buffer, unsigned *capacity, unsigned needed,
+                         size_t item_size) {
+    if (*capacity >= needed) {
+        return buffer;
+    }
 
-    // copy existing content (if any)
-    if (old_text && old_len > 0) {
-        memcpy(new_text, old_text, old_len);
+    unsigned new_capacity = *capacity ? *capacity * 2 : 256;
+    while (new_capacity < needed) {
+        new_capacity *= 2;
     }
 
-    // append new chunk
-    if (size > 0) {
-        memcpy(new_text + old_len, text, size);
+    buffer = realloc(buffer, new_capacity * item_size);
+    if (!buffer) {
+        printf("Cannot allocate heap memmory");
+        exit(1);
     }
+    *capacity = new_capacity;
+    return buffer;
+}
 
-    // replace buffer and free old
-    free(old_text);
-    accumulated_text_node->value.text.text = new_text;
-    accumulated_text_node->value.text.size = new_size;
+static void push_code_line(ParseState *state, unsigned offset) {
+    state->code_lines = grow_buffer(state->code_lines, &state->code_lines_capacity,
+                                    state->code_line_count + 1, sizeof(unsigned));
+    state->code_lines[state->code_line_count++] = offset;
 }
 
-// -------------------------------
-//  Node creation
-// -------------------------------
+static void start_text_accumulation(MarkdownDocument *doc, NodeIndex code_block) {
+    ParseState *state = &doc->parse;
+    state->parsing_code_block = true;
 
-static MarkdownNode *should_create_node(NodeType type) {
-    MarkdownNode *node = malloc(sizeof(MarkdownNode));
-    if (!node) {
-        printf("Cannot allocate heap memmory");
-        exit(1);
+    state->accumulated_code_block = code_block;
+    state->accumulated_text_node = should_create_node(&doc->tree, NODE_TEXT);
+    doc->tree.values[state->accumulated_text_node].text.type = MD_TEXT_NORMAL;
+
+    state->code_text_size = 0;
+    state->code_line_count = 0;
+    push_code_line(state, 0);
+}
+
+// NOTE: No need to manually append a null terminator; Clay handles both during rendering.
+// NOTE: md4c reports the code one line at a time followed by its "\n", so the line index is
+// built on the fly by looking for line breaks in the new chunk only.
+static void accumulate_text(ParseState *state, const MD_CHAR *text, MD_SIZE size) {
+    state->code_text = grow_buffer(state->code_text, &state->code_text_capacity,
+                                   state->code_text_size + size, sizeof(MD_CHAR));
+    memcpy(state->code_text + state->code_text_size, text, size);
+
+    for (MD_SIZE i = 0; i < size; i++) {
+        if (text[i] == '\n') {
+            push_code_line(state, state->code_text_size + i + 1);
+        }
     }
-    memset(node, 0, sizeof(MarkdownNode));
-    node->type = type;
-    return node;
+    state->code_text_size += size;
 }
 
-static void insert_child_node(MarkdownNode *parent, MarkdownNode *child) {
-    if (!parent || !child) return;
-    child->parent = parent;
-    if (!parent->first_child) {
-        parent->first_child = child;
-    } else {
-        MarkdownNode *s = parent->first_child;
-        while (s->next_sibling) s = s->next_sibling;
-        s->next_sibling = child;
+static void finish_text_accumulation(MarkdownDocument *doc) {
+    ParseState *state = &doc->parse;
+    state->parsing_code_block = false;
+
+    TextNode *node = &doc->tree.values[state->accumulated_text_node].text;
+    node->text = arena_strndup(&doc->arena, state->code_text, state->code_text_size);
+    node->size = state->code_text_size;
+
+    // A trailing line break does not start a new line
+    if (state->code_line_count > 0
+            && state->code_lines[state->code_line_count - 1] == state->code_text_size) {
+        state->code_line_count--;
     }
+
+    CodeBlockDetail *detail = arena_alloc(&doc->arena, sizeof(CodeBlockDetail));
+    unsigned *line_offsets = arena_alloc(&doc->arena, state->code_line_count * sizeof(unsigned));
+    memcpy(line_offsets, state->code_lines, state->code_line_count * sizeof(unsigned));
+    detail->line_count = state->code_line_count;
+    detail->line_offsets = line_offsets;
+    doc->tree.values[state->accumulated_code_block].block.detail = detail;
+}
+
+static void push_parsed_block(MarkdownDocument *doc, NodeIndex node) {
+    ParseState *state = &doc->parse;
+    state->blocks = grow_buffer(state->blocks, &state->blocks_capacity,
+                                state->block_count + 1, sizeof(TopLevelBlock));
+    state->blocks[state->block_count++] = (TopLevelBlock) {
+        .node = node,
+        .subtree_end = node + 1,
+    };
+}
+
+static void release_parse_state(ParseState *state) {
+    free(state->code_text);
+    free(state->code_lines);
+    free(state->blocks);
+    free(state->input);
+    *state = (ParseState) {
+        .current_node = NODE_NONE
+    };
 }
 
 // ------------------------------
 //  MD4C Callbacks
 // ------------------------------
 // NOTE: MD4C does not allocate heap memmory for most of detail structs, so we need to
-// handle this allocation manually.
+// handle this allocation manually (inside the document arena).
+// NOTE: The document being built is passed around as md4c's userdata.
 
 static int on_enter_block(MD_BLOCKTYPE type, void *detail, void *userdata) {
-    MarkdownNode *node = should_create_node(NODE_BLOCK);
-    node->value.block.type = type;
-    node->value.block.userdata = userdata;
+    MarkdownDocument *doc = userdata;
+    // Every chunk reports its own document block, they all share the root node
+    if (type == MD_BLOCK_DOC) {
+        doc->parse.current_node = NODE_ROOT;
+        return 0;
+    }
+
+    NodeIndex node = should_create_node(&doc->tree, NODE_BLOCK);
+    BlockNode *block = &doc->tree.values[node].block;
+    block->type = type;
 
     // Cast and store the block element’s details on the heap
     if (type == MD_BLOCK_H && detail) {
-        MD_BLOCK_H_DETAIL *copy = malloc(sizeof(MD_BLOCK_H_DETAIL));
-        if (!copy) {
-            exit(1);
-        }
+        MD_BLOCK_H_DETAIL *copy = arena_alloc(&doc->arena, sizeof(MD_BLOCK_H_DETAIL));
         *copy = *(MD_BLOCK_H_DETAIL*)detail;
-        node->value.block.detail = copy;
+        block->detail = copy;
     } else if (type == MD_BLOCK_OL && detail) {
-        MD_BLOCK_OL_DETAIL *copy = malloc(sizeof(MD_BLOCK_OL_DETAIL));
-        if (!copy) {
-            exit(1);
-        }
+        MD_BLOCK_OL_DETAIL *copy = arena_alloc(&doc->arena, sizeof(MD_BLOCK_OL_DETAIL));
         *copy = *(MD_BLOCK_OL_DETAIL*)detail;
-        node->value.block.detail = copy;
+        block->detail = copy;
     } else if (type == MD_BLOCK_CODE) {
-        start_text_accumulation();
+        start_text_accumulation(doc, node);
     } else {
         // TODO: handle all the detail cases
-        node->value.block.detail = detail;
+        block->detail = detail;
     }
 
-    // Insert node
-    if (!root_node) {
-        root_node = node;
-    } else {
-        insert_child_node(current_node, node);
+    if (doc->parse.current_node == NODE_ROOT) {
+        push_parsed_block(doc, node);
     }
+    insert_child_node(&doc->tree, doc->parse.current_node, node);
 
-    current_node = node; // descend
+    doc->parse.current_node = node; // descend
 
     return 0;
 }
 
 static int on_leave_block(MD_BLOCKTYPE type, void *detail, void *userdata) {
+    MarkdownDocument *doc = userdata;
     if (type == MD_BLOCK_CODE) {
-        parsing_code_block = false;
-        insert_child_node(current_node, accumulated_text_node);
+        finish_text_accumulation(doc);
+        insert_child_node(&doc->tree, doc->parse.current_node, doc->parse.accumulated_text_node);
+    }
+    if (type != MD_BLOCK_DOC && doc->tree.links[doc->parse.current_node].parent == NODE_ROOT) {
+        doc->parse.blocks[doc->parse.block_count - 1].subtree_end = doc->tree.count;
     }
     // Ignore the remaining function parameters, as the details are actually passed
     // in the opening block.
-    current_node = current_node->parent; // ascend
+    doc->parse.current_node = doc->tree.links[doc->parse.current_node].parent; // ascend
     return 0;
 }
 
 static int on_enter_span(MD_SPANTYPE type, void *detail, void *userdata) {
-    MarkdownNode *node = should_create_node(NODE_SPAN);
+    MarkdownDocument *doc = userdata;
+    NodeIndex node = should_create_node(&doc->tree, NODE_SPAN);
+    SpanNode *span = &doc->tree.values[node].span;
 
     // NOTE: expand for more used details
     if (type == MD_SPAN_IMG && detail) {
-        MD_SPAN_IMG_DETAIL *copy = malloc(sizeof(MD_SPAN_IMG_DETAIL));
-        if (!copy) {
-            exit(1);
-        }
-        *copy = *(MD_SPAN_IMG_DETAIL*)detail;
-        node->value.block.detail = copy;
+        MD_SPAN_IMG_DETAIL *img = detail;
+        ImageDetail *copy = arena_alloc(&doc->arena, sizeof(ImageDetail));
+        copy->src = img->src;
+        copy->title = img->title;
+        copy->image = IMAGE_NONE;
+        // The src string may live in a temporary md4c buffer (escaped or entity paths)
+        copy->src.text = arena_strndup(&doc->arena, copy->src.text, copy->src.size);
+        span->detail = copy;
     } else {
         // FIX: this should be null probably, because md4c is deallocating those pointers after
         // the callback call.
-        node->value.span.detail = detail;
+        span->detail = detail;
     }
 
-    node->value.span.type = type;
-    node->value.span.userdata = userdata;
+    span->type = type;
 
-    insert_child_node(current_node, node);
-    current_node = node;
+    insert_child_node(&doc->tree, doc->parse.current_node, node);
+    doc->parse.current_node = node;
     return 0;
 }
 
 static int on_leave_span(MD_SPANTYPE type, void *detail, void *userdata) {
-    current_node->value.span.type = type;
+    MarkdownDocument *doc = userdata;
+    doc->tree.values[doc->parse.current_node].span.type = type;
     // Same as on_leave_block, whe can ignore the parameters as the details are passed in the
     // opening block.
-    current_node = current_node->parent;
+    doc->parse.current_node = doc->tree.links[doc->parse.current_node].parent;
     return 0;
 }
 
 static int on_text(MD_TEXTTYPE type, const MD_CHAR *text, MD_SIZE size, void *userdata) {
-    if (parsing_code_block) {
-        accumulate_text(text, size);
+    MarkdownDocument *doc = userdata;
+    if (doc->parse.parsing_code_block) {
+        accumulate_text(&doc->parse, text, size);
         return 0;
     }
 
-    MarkdownNode *node = should_create_node(NODE_TEXT);
-    node->value.text.type = type;
-    node->value.text.size = size;
-    node->value.text.userdata = userdata;
+    NodeIndex node = should_create_node(&doc->tree, NODE_TEXT);
+    TextNode *text_node = &doc->tree.values[node].text;
+    text_node->type = type;
+    text_node->size = size;
 
-    node->value.text.text = malloc(size + 1);
-    memcpy(node->value.text.text, text, size);
-    node->value.text.text[size] = '\0';
+    ParseState *state = &doc->parse;
+    if (text >= state->input_chunk && text + size <= state->input_chunk + state->chunk_size) {
+        text = state->source_chunk + (text - state->input_chunk);
+    }
+    if (text >= doc->source && text + size <= doc->source + doc->source_size) {
+        text_node->text = text;
+        text_node->source_offset = (unsigned)(text - doc->source);
+        text_node->is_source_slice = true;
+    } else {
+        text_node->text = arena_strndup(&doc->arena, text, size);
+    }
 
-    insert_child_node(current_node, node);
+    insert_child_node(&doc->tree, doc->parse.current_node, node);
     return 0;
 }
 
 // ------------------------------
-//  Parser Markdown
+//  Source chunks
 // ------------------------------
+// NOTE: A chunk boundary is a non indented line right after a blank line, outside a fenced code
+// block, that cannot continue a list or a block quote. Nothing before such a line can change how
+// it is parsed, so each chunk can go through md4c on its own.
+
+static const char *skip_indent(const char *line, const char *end, unsigned *columns) {
+    *columns = 0;
+    while (line < end && (*line == ' ' || *line == '\t')) {
+        *columns = *line == '\t' ? (*columns + 4) & ~3u : *columns + 1;
+        line++;
+    }
+    return line;
+}
 
-// Note: it works using md4c function callbacks to build a elements tree out of the parsing results.
-int parse_markdown(const char* text) {
-    MD_SIZE size = strlen(text);
-
-    MD_PARSER parser = {
-        .abi_version = 0,
-        .flags = 0,
-        .enter_block = on_enter_block,
-        .leave_block = on_leave_block,
-        .enter_span = on_enter_span,
-        .leave_span = on_leave_span,
-        .text = on_text,
-        .debug_log = NULL,
-        .syntax = NULL
+static size_t count_run(const char *line, const char *end, char c) {
+    size_t count = 0;
+    while (line + count < end && line[count] == c) count++;
+    return count;
+}
+
+static bool is_blank(const char *line, const char *end) {
+    unsigned columns;
+    const char *content = skip_indent(line, end, &columns);
+    return content == end || (content + 1 == end && *content == '\r');
+}
+
+static bool starts_top_level_block(const char *line, const char *end) {
+    switch (*line) {
+    case '>': case '<': case '-': case '+': case '*':
+        return false;
+    default:
+        break;
+    }
+
+    // Ordered list items
+    const char *c = line;
+    while (c < end && isdigit((unsigned char)*c)) c++;
+    return c == line || c == end || (*c != '.' && *c != ')');
+}
+
+static bool starts_with_nocase(const char *line, const char *end, const char *prefix) {
+    size_t length = strlen(prefix);
+    return (size_t)(end - line) >= length && strncasecmp(line, prefix, length) == 0;
+}
+
+// Some raw HTML blocks can span blank lines, so documents that use them are parsed in one piece.
+static bool needs_single_chunk(const char *content, const char *end) {
+    return starts_with_nocase(content, end, "<!")
+        || starts_with_nocase(content, end, "<?")
+        || starts_with_nocase(content, end, "<pre")
+        || starts_with_nocase(content, end, "<script")
+        || starts_with_nocase(content, end, "<style")
+        || starts_with_nocase(content, end, "<textarea");
+}
+
+// Returns where the destination starts if the line looks like a link reference definition.
+static const char *definition_destination(const char *content, const char *end) {
+    if (*content != '[') return NULL;
+    for (const char *c = content + 1; c + 1 < end; c++) {
+        if (c[0] == ']' && c[1] == ':') return c + 2;
+    }
+    return NULL;
+}
+
+// Skips the block quote and list item markers in front of the content of a line
+static const char *skip_containers(const char *content, const char *end) {
+    for (;;) {
+        const char *c = content;
+        if (c < end && *c == '>') {
+            c++;
+        } else if (c + 1 < end && (*c == '-' || *c == '+' || *c == '*')
+                   && (c[1] == ' ' || c[1] == '\t')) {
+            c++;
+        } else {
+            while (c < end && c - content < 9 && isdigit((unsigned char)*c)) c++;
+            if (c == content || c + 1 >= end || (*c != '.' && *c != ')')
+                    || (c[1] != ' ' && c[1] != '\t')) {
+                return content;
+            }
+            c++;
+        }
+        unsigned columns;
+        content = skip_indent(c, end, &columns);
+    }
+}
+
+static void append_definition(char **definitions, unsigned *size, unsigned *capacity,
+                              const char *line, const char *end) {
+    size_t length = (size_t)(end - line);
+    *definitions = grow_buffer(*definitions, capacity, *size + length + 2, 1);
+    memcpy(*definitions + *size, line, length);
+    *size += length;
+    (*definitions)[(*size)++] = '\n';
+}
+
+static int reject_block(MD_BLOCKTYPE type, void *detail, void *userdata) {
+    (void)detail; (void)userdata;
+    return type == MD_BLOCK_DOC ? 0 : -1;
+}
+
+static int ignore_block(MD_BLOCKTYPE type, void *detail, void *userdata) {
+    (void)type; (void)detail; (void)userdata;
+    return 0;
+}
+
+static int ignore_span(MD_SPANTYPE type, void *detail, void *userdata) {
+    (void)type; (void)detail; (void)userdata;
+    return 0;
+}
+
+static int ignore_text(MD_TEXTTYPE type, const MD_CHAR *text, MD_SIZE size, void *userdata) {
+    (void)type; (void)text; (void)size; (void)userdata;
+    return 0;
+}
+
+// The collected lines must be nothing but definitions, md4c fails on the first block otherwise
+static const MD_PARSER definitions_parser = {
+    .abi_version = 0,
+    .enter_block = reject_block,
+    .leave_block = ignore_block,
+    .enter_span = ignore_span,
+    .leave_span = ignore_span,
+    .text = ignore_text,
+};
+
+static void push_chunk(SourceChunk **chunks, unsigned *count, unsigned *capacity,
+                       size_t start, size_t end) {
+    *chunks = grow_buffer(*chunks, capacity, *count + 1, sizeof(SourceChunk));
+    (*chunks)[(*count)++] = (SourceChunk) {
+        .start = start,
+        .end = end,
     };
+}
+
+// Link reference definitions apply to the whole document. The ones that take a single line,
+// between blank lines or other definitions, are collected so every chunk is parsed after them.
+// Anything less clear (a title on the next line, a definition right after a paragraph line,
+// inside a block quote or a list item, or indented) falls back to parsing the document in one
+// piece, as do the raw HTML blocks above.
+static SourceChunk *split_source(const char *text, size_t size, uint32_t *chunk_count,
+                                 char **definitions, size_t *definitions_size) {
+    SourceChunk *chunks = NULL;
+    unsigned count = 0;
+    unsigned capacity = 0;
+    char *collected = NULL;
+    unsigned collected_size = 0;
+    unsigned collected_capacity = 0;
+
+    size_t chunk_start = 0;
+    bool single_chunk = false;
+    bool previous_blank = true;
+    bool previous_definition = false;
+    bool in_fence = false;
+    char fence_char = 0;
+    size_t fence_length = 0;
+
+    size_t position = 0;
+    while (position < size) {
+        const char *line = text + position;
+        const char *newline = memchr(line, '\n', size - position);
+        const char *end = newline ? newline : text + size;
+        size_t next = newline ? (size_t)(newline - text) + 1 : size;
+
+        unsigned columns;
+        const char *content = skip_indent(line, end, &columns);
+        bool blank = is_blank(line, end);
+        bool definition = false;
+
+        if (in_fence) {
+            size_t run = columns < 4 ? count_run(content, end, fence_char) : 0;
+            if (run >= fence_length && is_blank(content + run, end)) {
+                in_fence = false;
+            }
+        } else if (!blank) {
+            if (previous_blank && columns == 0 && position - chunk_start >= CHUNK_MIN_SIZE
+                    && starts_top_level_block(line, end)) {
+                push_chunk(&chunks, &count, &capacity, chunk_start, position);
+                chunk_start = position;
+            }
+
+            if (columns < 4 && (*content == '`' || *content == '~')
+                    && count_run(content, end, *content) >= 3) {
+                in_fence = true;
+                fence_char = *content;
+                fence_length = count_run(content, end, *content);
+            } else if (columns < 4 && definition_destination(content, end)) {
+                definition = true;
+            }
+
+            const char *destination = definition ? definition_destination(content, end) : NULL;
+            if ((columns < 4 && needs_single_chunk(content, end))
+                    || (definition && (!(previous_blank || previous_definition)
+                                       || is_blank(destination, end)))
+                    || (!definition && previous_definition)
+                    || (!definition && definition_destination(skip_containers(content, end), end))) {
+                single_chunk = true;
+                break;
+            }
+            if (definition) {
+                append_definition(&collected, &collected_size, &collected_capacity, line, end);
+            }
+        }
+
+        previous_blank = blank;
+        previous_definition = definition;
+        position = next;
+    }
 
-    root_node = NULL;
-    current_node = NULL;
+    if (collected && !single_chunk) {
+        // A blank line keeps the chunk from continuing the last definition
+        collected[collected_size++] = '\n';
+        single_chunk = md_parse(collected, collected_size, &definitions_parser, NULL) != 0;
+    }
+    if (single_chunk) {
+        count = 0;
+        chunk_start = 0;
+        free(collected);
+        collected = NULL;
+        collected_size = 0;
+    }
 
-    return md_parse(text, size, &parser, NULL);
+    if (chunk_start < size || count == 0) {
+        push_chunk(&chunks, &count, &capacity, chunk_start, size);
+    }
+    *chunk_count = count;
+    *definitions = collected;
+    *definitions_size = collected_size;
+    return chunks;
 }
 
 // ------------------------------
-//  Tree traverse operations API
+//  Parser Markdown
 // ------------------------------
 
-MarkdownNode *get_root_node(void) {
-    return root_node;
+// Note: it works using md4c function callbacks to build a elements tree out of the parsing results.
+// Every call works on its own document, so several documents can be parsed at the same time
+// from different threads.
+static const MD_PARSER parser = {
+    .abi_version = 0,
+    .flags = 0,
+    .enter_block = on_enter_block,
+    .leave_block = on_leave_block,
+    .enter_span = on_enter_span,
+    .leave_span = on_leave_span,
+    .text = on_text,
+    .debug_log = NULL,
+    .syntax = NULL
+};
+
+// Parses the chunks [first, end) into the tree, their blocks are collected in parse.blocks.
+static bool parse_chunks(MarkdownDocument *doc, SourceChunk *chunks, uint32_t first,
+                         uint32_t end, uint32_t first_block) {
+    ParseState *state = &doc->parse;
+    for (uint32_t i = first; i < end; i++) {
+        unsigned parsed = state->block_count;
+        state->current_node = NODE_NONE;
+        state->source_chunk = doc->source + chunks[i].start;
+        state->chunk_size = chunks[i].end - chunks[i].start;
+        state->input_chunk = state->source_chunk;
+
+        const char *input = state->source_chunk;
+        size_t input_size = state->chunk_size;
+        if (doc->definitions_size) {
+            input_size += doc->definitions_size;
+            if (input_size > (MD_SIZE)-1) {
+                return false;
+            }
+            state->input = grow_buffer(state->input, &state->input_capacity, (unsigned)input_size, 1);
+            memcpy(state->input, doc->definitions, doc->definitions_size);
+            memcpy(state->input + doc->definitions_size, state->source_chunk, state->chunk_size);
+            input = state->input;
+            state->input_chunk = state->input + doc->definitions_size;
+        }
+
+        int result = md_parse(input, (MD_SIZE)input_size, &parser, doc);
+        if (result != 0) {
+            return false;
+        }
+        chunks[i].first_block = first_block + parsed;
+        chunks[i].block_count = state->block_count - parsed;
+    }
+    return true;
+}
+
+static void link_top_level_blocks(MarkdownDocument *doc) {
+    NodeLinks *root = &doc->tree.links[NODE_ROOT];
+    root->first_child = NODE_NONE;
+    root->last_child = NODE_NONE;
+    for (uint32_t i = 0; i < doc->block_count; i++) {
+        doc->tree.links[doc->blocks[i].node].next_sibling = NODE_NONE;
+        insert_child_node(&doc->tree, NODE_ROOT, doc->blocks[i].node);
+    }
+}
+
+static TopLevelBlock *alloc_blocks(uint32_t count) {
+    TopLevelBlock *blocks = malloc((count ? count : 1) * sizeof(TopLevelBlock));
+    if (!blocks) {
+        printf("Cannot allocate heap memmory");
+        exit(1);
+    }
+    return blocks;
 }
 
-void free_tree(MarkdownNode *node) {
-    if (!node) return;
+// Drops the previous tree, if any, and leaves an empty document over the given chunks
+static void reset_document(MarkdownDocument *doc, SourceChunk *chunks, uint32_t chunk_count) {
+    doc->tree.count = 0;
+    arena_release(&doc->arena);
+    free(doc->blocks);
+    free(doc->chunks);
+    doc->blocks = NULL;
+    doc->block_count = 0;
+    doc->blocks_capacity = 0;
+    doc->chunks = chunks;
+    doc->chunk_count = chunk_count;
+    doc->parsed_chunks = 0;
+    doc->garbage_nodes = 0;
+
+    NodeIndex root = should_create_node(&doc->tree, NODE_BLOCK);
+    doc->tree.values[root].block.type = MD_BLOCK_DOC;
+}
 
-    MarkdownNode *child = node->first_child;
-    while (child) {
-        MarkdownNode *next = child->next_sibling;
-        free_tree(child);
-        child = next;
+bool parse_next_chunk(MarkdownDocument *doc) {
+    if (document_is_parsed(doc)) {
+        return true;
     }
-    if (node->type == NODE_TEXT && node->value.text.text) {
-        free(node->value.text.text);
+
+    uint32_t chunk = doc->parsed_chunks;
+    if (!parse_chunks(doc, doc->chunks, chunk, chunk + 1, doc->block_count)) {
+        release_parse_state(&doc->parse);
+        return false;
     }
-    if (node->type == NODE_BLOCK &&
-            node->value.block.type == MD_BLOCK_H &&
-            node->value.block.detail) {
-        free(node->value.block.detail);
+
+    // Publish the new blocks, md4c already linked them to the root
+    ParseState *state = &doc->parse;
+    doc->blocks = grow_buffer(doc->blocks, &doc->blocks_capacity,
+                              doc->block_count + state->block_count, sizeof(TopLevelBlock));
+    memcpy(doc->blocks + doc->block_count, state->blocks, state->block_count * sizeof(TopLevelBlock));
+    doc->block_count += state->block_count;
+    state->block_count = 0;
+    doc->parsed_chunks++;
+
+    // The scratch buffers are reused by every chunk
+    if (document_is_parsed(doc)) {
+        release_parse_state(state);
     }
+    return true;
+}
 
-    free(node);
+// Parses the whole source from scratch, dropping the previous tree if any.
+static bool build_document(MarkdownDocument *doc, SourceChunk *chunks, uint32_t chunk_count) {
+    reset_document(doc, chunks, chunk_count);
+    while (!document_is_parsed(doc)) {
+        if (!parse_next_chunk(doc)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+MarkdownDocument *begin_document(const char *text, size_t size) {
+    // md4c works with 32 bit sizes
+    if (size > (MD_SIZE)-1) {
+        printf("Document too big to be parsed\n");
+        return NULL;
+    }
+
+    MarkdownDocument *doc = calloc(1, sizeof(MarkdownDocument));
+    if (!doc) {
+        printf("Cannot allocate heap memmory");
+        exit(1);
+    }
+    doc->source = text;
+    doc->source_size = size;
+    doc->parse.current_node = NODE_NONE;
+
+    uint32_t chunk_count;
+    SourceChunk *chunks = split_source(text, size, &chunk_count,
+                                       &doc->definitions, &doc->definitions_size);
+    reset_document(doc, chunks, chunk_count);
+    return doc;
+}
+
+MarkdownDocument *parse_markdown(const char* text, size_t size) {
+    MarkdownDocument *doc = begin_document(text, size);
+    if (!doc) {
+        return NULL;
+    }
+
+    while (!document_is_parsed(doc)) {
+        if (!parse_next_chunk(doc)) {
+            free_document(doc);
+            return NULL;
+        }
+    }
+    return doc;
+}
+
+// Points the source slices of the blocks [first, end) to the current source, moved by shift.
+static void rebase_blocks(MarkdownDocument *doc, uint32_t first, uint32_t end, ptrdiff_t shift) {
+    for (uint32_t i = first; i < end; i++) {
+        for (NodeIndex node = doc->blocks[i].node; node < doc->blocks[i].subtree_end; node++) {
+            TextNode *text = &doc->tree.values[node].text;
+            if (doc->tree.types[node] != NODE_TEXT || !text->is_source_slice) continue;
+            text->source_offset = (unsigned)((ptrdiff_t)text->source_offset + shift);
+            text->text = doc->source + text->source_offset;
+        }
+    }
+}
+
+bool update_markdown(MarkdownDocument *doc, const char *text, size_t size, DocumentSplice *splice) {
+    if (size > (MD_SIZE)-1) {
+        printf("Document too big to be parsed\n");
+        *splice = (DocumentSplice) {0};
+        return false;
+    }
+
+    uint32_t chunk_count;
+    char *definitions;
+    size_t definitions_size;
+    SourceChunk *chunks = split_source(text, size, &chunk_count, &definitions, &definitions_size);
+
+    // References in the kept chunks may resolve to something else once the definitions change
+    bool definitions_changed = definitions_size != doc->definitions_size
+        || (definitions_size && memcmp(definitions, doc->definitions, definitions_size) != 0);
+    free(doc->definitions);
+    doc->definitions = definitions;
+    doc->definitions_size = definitions_size;
+
+    // Bytes shared by both versions at the start and at the end
+    const char *old_text = doc->source;
+    size_t old_size = doc->source_size;
+    size_t limit = old_size < size ? old_size : size;
+    size_t prefix = 0;
+    while (prefix < limit && old_text[prefix] == text[prefix]) prefix++;
+    size_t suffix = 0;
+    while (suffix < limit - prefix && old_text[old_size - 1 - suffix] == text[size - 1 - suffix]) {
+        suffix++;
+    }
+    ptrdiff_t shift = (ptrdiff_t)size - (ptrdiff_t)old_size;
+
+    // Chunks with the same bounds and the same bytes parse to the same blocks
+    uint32_t kept_prefix = 0;
+    while (kept_prefix < doc->chunk_count && kept_prefix < chunk_count
+            && doc->chunks[kept_prefix].end <= prefix
+            && chunks[kept_prefix].start == doc->chunks[kept_prefix].start
+            && chunks[kept_prefix].end == doc->chunks[kept_prefix].end) {
+        kept_prefix++;
+    }
+    uint32_t kept_suffix = 0;
+    while (kept_prefix + kept_suffix < doc->chunk_count && kept_prefix + kept_suffix < chunk_count) {
+        const SourceChunk *old_chunk = &doc->chunks[doc->chunk_count - 1 - kept_suffix];
+        const SourceChunk *new_chunk = &chunks[chunk_count - 1 - kept_suffix];
+        if (old_chunk->start < old_size - suffix
+                || new_chunk->start != (size_t)((ptrdiff_t)old_chunk->start + shift)
+                || new_chunk->end != (size_t)((ptrdiff_t)old_chunk->end + shift)) {
+            break;
+        }
+        kept_suffix++;
+    }
+
+    uint32_t first_block = kept_prefix ? doc->chunks[kept_prefix - 1].first_block
+                                         + doc->chunks[kept_prefix - 1].block_count : 0;
+    uint32_t suffix_block = kept_suffix ? doc->chunks[doc->chunk_count - kept_suffix].first_block
+                                        : doc->block_count;
+    uint32_t removed_nodes = 0;
+    for (uint32_t i = first_block; i < suffix_block; i++) {
+        removed_nodes += doc->blocks[i].subtree_end - doc->blocks[i].node;
+    }
+
+    doc->source = text;
+    doc->source_size = size;
+    uint32_t old_block_count = doc->block_count;
+
+    // Replaced nodes stay in the tree until there are too many of them
+    if (definitions_changed || doc->garbage_nodes + removed_nodes > doc->tree.count / 2) {
+        bool parsed = build_document(doc, chunks, chunk_count);
+        *splice = (DocumentSplice) {
+            .first_block = 0,
+            .removed = old_block_count,
+            .inserted = doc->block_count,
+        };
+        return parsed;
+    }
+
+    rebase_blocks(doc, 0, first_block, 0);
+    rebase_blocks(doc, suffix_block, old_block_count, shift);
+
+    if (!parse_chunks(doc, chunks, kept_prefix, chunk_count - kept_suffix, first_block)) {
+        release_parse_state(&doc->parse);
+        bool parsed = build_document(doc, chunks, chunk_count);
+        *splice = (DocumentSplice) {
+            .first_block = 0,
+            .removed = old_block_count,
+            .inserted = doc->block_count,
+        };
+        return parsed;
+    }
+
+    uint32_t inserted = doc->parse.block_count;
+    uint32_t kept_after = old_block_count - suffix_block;
+    TopLevelBlock *blocks = alloc_blocks(first_block + inserted + kept_after);
+    memcpy(blocks, doc->blocks, first_block * sizeof(TopLevelBlock));
+    memcpy(blocks + first_block, doc->parse.blocks, inserted * sizeof(TopLevelBlock));
+    memcpy(blocks + first_block + inserted, doc->blocks + suffix_block,
+           kept_after * sizeof(TopLevelBlock));
+    release_parse_state(&doc->parse);
+
+    for (uint32_t i = 0; i < kept_prefix; i++) {
+        chunks[i].first_block = doc->chunks[i].first_block;
+        chunks[i].block_count = doc->chunks[i].block_count;
+    }
+    for (uint32_t i = 0; i < kept_suffix; i++) {
+        const SourceChunk *old_chunk = &doc->chunks[doc->chunk_count - kept_suffix + i];
+        SourceChunk *chunk = &chunks[chunk_count - kept_suffix + i];
+        chunk->first_block = old_chunk->first_block - suffix_block + first_block + inserted;
+        chunk->block_count = old_chunk->block_count;
+    }
+
+    free(doc->blocks);
+    free(doc->chunks);
+    doc->blocks = blocks;
+    doc->block_count = first_block + inserted + kept_after;
+    doc->blocks_capacity = doc->block_count;
+    doc->chunks = chunks;
+    doc->chunk_count = chunk_count;
+    doc->parsed_chunks = chunk_count;
+    doc->garbage_nodes += removed_nodes;
+    link_top_level_blocks(doc);
+
+    *splice = (DocumentSplice) {
+        .first_block = first_block,
+        .removed = suffix_block - first_block,
+        .inserted = inserted,
+    };
+    return true;
+}
+
+// ------------------------------
+//  Tree traverse operations API
+// ------------------------------
+
+// Releases the whole tree at once: three node arrays plus the arena chunks.
+void free_document(MarkdownDocument *doc) {
+    if (!doc) return;
+
+    free(doc->tree.types);
+    free(doc->tree.links);
+    free(doc->tree.values);
+    free(doc->blocks);
+    free(doc->chunks);
+    free(doc->definitions);
+    arena_release(&doc->arena);
+    release_parse_state(&doc->parse);
+    free(doc);
 }
 
 // ------------------------------
@@ -343,29 +941,36 @@ static const char* text_type_name(MD_TEXTTYPE t) {
     }
 }
 
-void print_tree(const MarkdownNode *node, int indent) {
-    while (node) {
+void print_tree(const MarkdownTree *tree, NodeIndex node, int indent) {
+    while (node != NODE_NONE) {
         for (int i = 0; i < indent; i++) printf("\t");
 
-        switch (node->type) {
-        case NODE_TEXT:
-            if (node->value.text.type == MD_TEXT_SOFTBR) {
-                printf("[TEXT] type=%s\n", text_type_name(node->value.text.type));
+        switch (node_type(tree, node)) {
+        case NODE_TEXT: {
+            const TextNode *text = node_text(tree, node);
+            if (text->type == MD_TEXT_SOFTBR) {
+                printf("[TEXT] type=%s\n", text_type_name(text->type));
+                break;
+            }
+            if (text->type == MD_TEXT_BR) {
+                printf("[TEXT] type=%s text='\\n'\n", text_type_name(text->type));
                 break;
             }
-            if (node->value.text.type == MD_TEXT_BR) {
-                printf("[TEXT] type=%s text='\\n'\n", text_type_name(node->value.text.type));
+            if (!text->text) {
+                printf("[TEXT] type=%s, text='(null)'\n", text_type_name(text->type));
                 break;
             }
-            printf("[TEXT] type=%s, text='%s'\n",
-                   text_type_name(node->value.text.type),
-                   node->value.text.text ? node->value.text.text : "(null)");
+            printf("[TEXT] type=%s, text='%.*s'\n",
+                   text_type_name(text->type),
+                   (int)text->size, text->text);
             break;
-        case NODE_SPAN:
-            printf("[SPAN] type=%s", span_type_name(node->value.span.type));
+        }
+        case NODE_SPAN: {
+            const SpanNode *span = node_span(tree, node);
+            printf("[SPAN] type=%s", span_type_name(span->type));
 
-            if (node->value.span.type == MD_SPAN_IMG) {
-                MD_SPAN_IMG_DETAIL *detail = (MD_SPAN_IMG_DETAIL*) node->value.span.detail;
+            if (span->type == MD_SPAN_IMG) {
+                const ImageDetail *detail = (const ImageDetail*) span->detail;
                 MD_ATTRIBUTE src = detail->src;
 
                 printf(" | img src=\"%.*s\"", (int)src.size, src.text);
@@ -373,18 +978,19 @@ void print_tree(const MarkdownNode *node, int indent) {
 
             printf("\n");
             break;
+        }
         case NODE_BLOCK:
             printf("[BLOCK] type=%s\n",
-                   block_type_name(node->value.block.type));
+                   block_type_name(node_block(tree, node)->type));
             break;
         default:
             printf("[UNKNOWN NODE]\n");
             break;
         }
 
-        if (node->first_child)
-            print_tree(node->first_child, indent + 1);
+        if (node_first_child(tree, node) != NODE_NONE)
+            print_tree(tree, node_first_child(tree, node), indent + 1);
 
-        node = node->next_sibling;
+        node = node_next_sibling(tree, node);
     }
 }
@@ -6,7 +6,9 @@
 #define PARSER_H
 
 #include "md4c.h"
+#include "arena.h"
 #include <stdbool.h>
+#include <stdint.h>
 
 // ------------------------------
 //  ENUMS y STRUCTS básicos
@@ -18,49 +20,204 @@ typedef enum {
     NODE_BLOCK
 } NodeType;
 
+// Text is not NUL terminated. When the chunk comes straight from the parsed buffer it is just
+// a slice of it (source_offset, size), so that buffer must outlive the tree. Only the text
+// synthesized by md4c (line breaks, NULL char replacements) is copied into the tree.
 typedef struct {
     MD_TEXTTYPE type;
-    char *text;
+    bool is_source_slice;
     unsigned size;
-    void *userdata;
+    unsigned source_offset; // valid when is_source_slice is true
+    const char *text;
 } TextNode;
 
 typedef struct {
     MD_SPANTYPE type;
     void *detail;           // pointer from MD4C (no ownership)
-    void *userdata;
 } SpanNode;
 
 typedef struct {
     MD_BLOCKTYPE type;
     void *detail;           // pointer from MD4C (no ownership)
-    void *userdata;
 } BlockNode;
 
+// Detail of MD_BLOCK_CODE blocks. The code itself is the only child of the block (a text
+// node), and line_offsets holds where every line starts inside it.
+typedef struct {
+    unsigned line_count;
+    const unsigned *line_offsets;
+} CodeBlockDetail;
+
+// Detail of MD_SPAN_IMG spans: md4c's attributes, plus the handle the renderer gives to the
+// image the first time the span is laid out, so it does not look the path up again.
+typedef struct {
+    MD_ATTRIBUTE src;
+    MD_ATTRIBUTE title;
+    int image;              // IMAGE_NONE until the renderer registers it
+} ImageDetail;
+
+#define IMAGE_NONE (-1)
+
+// ------------------------------
+//  Tree storage
+// ------------------------------
+
+// Nodes live in contiguous arrays and refer to each other by index. The root (the document
+// block) is always node 0 and NODE_NONE marks a missing link.
+typedef uint32_t NodeIndex;
+
+#define NODE_NONE ((NodeIndex)UINT32_MAX)
+#define NODE_ROOT ((NodeIndex)0)
+
+typedef struct {
+    NodeIndex parent;
+    NodeIndex first_child;
+    NodeIndex last_child;   // keeps appending a child O(1)
+    NodeIndex next_sibling;
+} NodeLinks;
+
+typedef union {
+    TextNode text;
+    SpanNode span;
+    BlockNode block;
+} NodeValue;
+
+typedef struct {
+    NodeType *types;
+    NodeLinks *links;
+    NodeValue *values;
+    uint32_t count;
+    uint32_t capacity;
+} MarkdownTree;
+
+static inline NodeType node_type(const MarkdownTree *tree, NodeIndex node) {
+    return tree->types[node];
+}
+
+static inline NodeIndex node_first_child(const MarkdownTree *tree, NodeIndex node) {
+    return tree->links[node].first_child;
+}
+
+static inline NodeIndex node_next_sibling(const MarkdownTree *tree, NodeIndex node) {
+    return tree->links[node].next_sibling;
+}
+
+static inline const TextNode *node_text(const MarkdownTree *tree, NodeIndex node) {
+    return &tree->values[node].text;
+}
+
+static inline const SpanNode *node_span(const MarkdownTree *tree, NodeIndex node) {
+    return &tree->values[node].span;
+}
+
+static inline const BlockNode *node_block(const MarkdownTree *tree, NodeIndex node) {
+    return &tree->values[node].block;
+}
+
 // ------------------------------
-//  Tree node
+//  Document
 // ------------------------------
 
-typedef struct MarkdownNode {
-    NodeType type;
-    union {
-        TextNode text;
-        SpanNode span;
-        BlockNode block;
-    } value;
+// Top-level blocks in document order. Blocks of an incremental reparse are appended at the end
+// of the tree, so the node range is the way to walk the subtree of a block.
+typedef struct {
+    NodeIndex node;
+    NodeIndex subtree_end;  // one past the last node of the block
+} TopLevelBlock;
+
+// The source is parsed in chunks split at lines that always start a new top-level block, so a
+// chunk parses the same on its own and only the chunks touched by an edit need a reparse.
+typedef struct {
+    size_t start;
+    size_t end;
+    uint32_t first_block;
+    uint32_t block_count;
+} SourceChunk;
+
+// Reported by update_markdown: the blocks [first_block, first_block + removed) of the previous
+// version were replaced by [first_block, first_block + inserted).
+typedef struct {
+    uint32_t first_block;
+    uint32_t removed;
+    uint32_t inserted;
+} DocumentSplice;
+
+// Scratch state used only while md4c walks the document
+typedef struct {
+    NodeIndex current_node;
+
+    // Code blocks are accumulated in buffers that grow geometrically and are reused by every
+    // block of the document; the final contents are copied into the arena once.
+    bool parsing_code_block;
+    NodeIndex accumulated_text_node;
+    NodeIndex accumulated_code_block;
+    MD_CHAR *code_text;
+    MD_SIZE code_text_size;
+    MD_SIZE code_text_capacity;
+    unsigned *code_lines;
+    unsigned code_line_count;
+    unsigned code_lines_capacity;
+
+    // Top-level blocks found by the chunks parsed so far
+    TopLevelBlock *blocks;
+    unsigned block_count;
+    unsigned blocks_capacity;
 
-    struct MarkdownNode *parent;
-    struct MarkdownNode *first_child;
-    struct MarkdownNode *next_sibling;
-} MarkdownNode;
+    // What md4c is walking: the link definitions followed by a copy of the chunk. Text inside
+    // the copy is mapped back to the source.
+    char *input;
+    unsigned input_capacity;
+    const char *input_chunk;    // the chunk inside input
+    const char *source_chunk;   // the chunk inside the source
+    size_t chunk_size;
+} ParseState;
+
+// A parsed document. It owns its tree, so any number of them can coexist.
+typedef struct {
+    MarkdownTree tree;
+    Arena arena;            // text payloads and detail copies
+    const char *source;     // parsed buffer, referenced by the text nodes
+    size_t source_size;
+    TopLevelBlock *blocks;
+    uint32_t block_count;
+    unsigned blocks_capacity;
+    SourceChunk *chunks;
+    uint32_t chunk_count;
+    uint32_t parsed_chunks; // chunks whose blocks are already in the tree
+    uint32_t garbage_nodes; // nodes of replaced blocks, still in the tree
+    char *definitions;      // link reference definitions of the whole source, for every chunk
+    size_t definitions_size;
+    ParseState parse;
+} MarkdownDocument;
 
 // ------------------------------
 //  Funciones principales
 // ------------------------------
 
-int parse_markdown(const char* text);
-void free_tree(MarkdownNode *node);
-void print_tree(const MarkdownNode *node, int indent);
-MarkdownNode *get_root_node(void);  // Returns the root node
+// text does not need to be NUL terminated, and it must outlive the returned document.
+// Returns NULL if the document cannot be parsed.
+MarkdownDocument *parse_markdown(const char* text, size_t size);
+
+// Progressive parsing: begin_document() returns a document with no blocks yet, and every call
+// to parse_next_chunk() appends the blocks of one more chunk. Blocks already in the document
+// do not change while the rest is being parsed. parse_next_chunk() returns false on failure.
+MarkdownDocument *begin_document(const char *text, size_t size);
+bool parse_next_chunk(MarkdownDocument *doc);
+
+static inline bool document_is_parsed(const MarkdownDocument *doc) {
+    return doc->parsed_chunks == doc->chunk_count;
+}
+
+// Bytes of the source already parsed
+static inline size_t document_parsed_size(const MarkdownDocument *doc) {
+    return doc->parsed_chunks ? doc->chunks[doc->parsed_chunks - 1].end : 0;
+}
+
+// Only for fully parsed documents. Reparses only the chunks that differ in the new version of the source and splices their
+// blocks into the tree. The text replaces the previous one, which can be released afterwards.
+// A text too big for md4c is rejected: the document keeps the previous one and nothing is spliced.
+bool update_markdown(MarkdownDocument *doc, const char *text, size_t size, DocumentSplice *splice);
+void free_document(MarkdownDocument *doc);  // Releases the document and every node of it
+void print_tree(const MarkdownTree *tree, NodeIndex node, int indent);
 
 #endif // PARSER_H
@@ -9,6 +9,9 @@
 #include "md4c/md4c.h"
 
 #include "render.h"
+#include "watcher.h"
+#include "glyph_atlas.h"
+#include "image_loader.h"
 
 #include <ft2build.h>
 #include FT_FREETYPE_H
@@ -21,6 +24,8 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
 
 // ============================================================================
 // CONSTANTS AND CONFIGURATION
@@ -55,6 +60,7 @@
 #define RAYLIB_VECTOR2_TO_CLAY_VECTOR2(vector) (Clay_Vector2) { .x = vector.x, .y = vector.y }
 #define MAIN_LAYOUT_ID "main_layout"
 #define IMG_SCALING_FACTOR 0.6f
+#define DEFAULT_TEXTURE_BUDGET_MB 256
 
 // List modes
 typedef enum {
@@ -93,6 +99,22 @@ static FT_Library g_freetype_lib = NULL;
 
 // Fonts
 static Font g_fonts[FONT_COUNT];
+static GlyphAtlas g_glyph_atlases[FONT_COUNT];
+
+// Faces are loaded by worker threads, the main thread only uploads their atlases. Until a
+// face is ready the text styles use the regular one, which the first frame waits for.
+typedef struct {
+    char path[PATH_MAX];
+    int pixel_size;
+    bool sdf;
+    bool loaded;        // result of glyph_atlas_load()
+    int done;           // set by the worker (atomic)
+    bool running;
+    pthread_t thread;
+} FontLoad;
+
+static FontLoad g_font_loads[FONT_COUNT];
+static bool g_font_ready[FONT_COUNT];
 
 // Text styles
 static Clay_TextElementConfig g_font_body_regular;
@@ -104,58 +126,225 @@ static Clay_TextElementConfig g_font_h3;
 static Clay_TextElementConfig g_font_h4;
 static Clay_TextElementConfig g_font_h5;
 static Clay_TextElementConfig g_font_inline_code;
+static Clay_TextElementConfig g_font_code_block;
 
 // --- Text rendering system ---
 
-// Represents the amount of chars that can be displayed inside a single line of text with the
-// current screen size. It is calculated on every loop cicle using the screen size and the font
-// size.
-static int g_available_characters = 0;
-
 #define MAX_TEXT_ELEMENTS 256
-#define INITIAL_TEMP_TEXT_CAPACITY 256
 
 typedef struct {
     Clay_String string;
     Clay_TextElementConfig* config;
 } TextElement;
 
+// Line being filled by textline_push(). Widths are in pixels, measured with the advances of
+// the font of every element, the same way Clay measures them.
 typedef struct {
     TextElement elements[MAX_TEXT_ELEMENTS];
     int count;
-    int char_count;
+    float width;
+    float max_width;
 } TextLine;
 
 static TextLine g_current_line;
 
-// Temporary text buffers
-static char** g_temp_text_buffers = NULL;
-static int g_temp_text_count = 0;
-static int g_temp_text_capacity = 0;
+// Wrapped lines of every paragraph laid out so far, so a paragraph is only broken again when
+// its width or the font size changes. Entries index a shared pool of elements and of line
+// lengths, open addressing by node.
+typedef struct {
+    NodeIndex node;        // NODE_NONE for free slots
+    float width;
+    int font_size;
+    uint32_t first_element;
+    uint32_t first_line;
+    uint32_t line_count;
+} LineCacheEntry;
+
+typedef struct {
+    LineCacheEntry *entries;
+    unsigned capacity;     // power of two
+    unsigned count;
+    TextElement *elements;
+    unsigned element_count;
+    unsigned elements_capacity;
+    unsigned *line_lengths; // elements per line
+    unsigned line_count;
+    unsigned lines_capacity;
+    bool recording;        // textline_flush() appends the lines it emits to the pools
+} LineCache;
+
+#define LINE_CACHE_MAX_ELEMENTS (1 << 20) // start over past this, old entries pile up
+
+static LineCache g_line_cache;
+
+// Words of the text nodes laid out so far, measured once per font: a word ends right after
+// its trailing spaces, which is where lines may break. A paragraph broken again at another
+// width (the window being resized) adds up words instead of measuring every codepoint.
+typedef struct {
+    int end;                // byte after the trailing spaces, the word starts where the last ended
+    float width;            // trailing spaces included
+    float content_width;    // up to the last non space codepoint, spaces may hang past the line
+    bool spaces_only;       // never wraps, like the spaces it holds
+} TextWord;
+
+typedef struct {
+    NodeIndex node;         // NODE_NONE for free slots
+    uint16_t font_id;
+    uint16_t font_size;
+    uint16_t letter_spacing;
+    uint32_t first_word;
+    uint32_t word_count;
+} WordCacheEntry;
+
+typedef struct {
+    WordCacheEntry *entries;
+    unsigned capacity;      // power of two
+    unsigned count;
+    TextWord *words;
+    unsigned word_count;
+    unsigned words_capacity;
+} WordCache;
+
+#define WORD_CACHE_MAX_WORDS (1 << 20) // start over past this, like the line cache
+
+static WordCache g_word_cache;
+
+// Strings built while laying out a frame (list numbers). Document text is never copied, Clay
+// strings point straight into the source or the document arena. The render commands of a
+// frame reference these, so the arena is reset right before the next layout replaces them.
+static Arena g_frame_arena;
 
 // ---- Images storage -----
 
 /*
- * ASYNC IMAGE LOADING EXPLANATION: 
- * - Thread loads ONLY Image (RAM pixels) using LoadImage()
- * - Stores it in pending_image and sets has_pending_image = true 
- * - Main thread (in update_pending_textures()) detects has_pending_image, 
- *   calls LoadTextureFromImage(). ONLY here we touch OpenGL 
- * - After upload, unloads the RAM Image and clears the flag
+ * ASYNC IMAGE LOADING EXPLANATION:
+ * - Images are decoded by the workers of g_image_loader, ONLY to an Image (RAM pixels)
+ * - Every layout asks for the images it emits, with the distance of their block from the
+ *   viewport. The nearest ones are decoded first, and the queued ones that the layout did
+ *   not ask for again (scrolled far away) are cancelled until they come back
+ * - Main thread (in update_pending_textures()) picks up the decoded images and copies them
+ *   to their textures a few rows per frame, within TEXTURE_UPLOAD_BUDGET bytes, nearest to
+ *   the viewport first. ONLY here we touch OpenGL. Mipmaps are made by the GPU at the end
+ * - Images are decoded at the largest size they are displayed at, and loaded again if the
+ *   window grows. Past the texture memory budget, the textures the last layout did not use
+ *   are unloaded, least recently used first, and load again when they come back
  */
+typedef enum {
+    IMAGE_IDLE,     // not asked for yet, or cancelled
+    IMAGE_QUEUED,
+    IMAGE_LOADED,
+    IMAGE_FAILED,
+} ImageState;
+
 typedef struct {
-    char *path;
+    const char *path;       // interned, NUL terminated
     unsigned path_size;
-    bool is_image_loaded;
-    bool has_pending_image;    // true when LoadImage() finished and Image is ready for GPU upload
-    Image pending_image;       // loaded in worker thread (pixels in RAM only)
+    uint64_t path_hash;
+    ImageState state;
     Texture2D image;
+    int width;              // of the image file, known after the first load
+    int height;
+    unsigned last_used;     // layout that emitted it last
+    float distance;         // of its block from the viewport, in that layout
+    bool uploading;         // decoded, being copied to a new texture
+    bool keep_texture;      // a bigger texture could not be decoded, do not ask again
 } ImageInfo;
 
-// This array stores the image data to then be freed when the app is cleaned
-// I mean, more than 200 images inside a markdown file is just absurd man.
-ImageInfo images[256];
-int images_array_pointer = -1;
+// Every image referenced by the document. Its handle is the index in g_images, kept by the
+// image spans (ImageDetail), and paths are looked up in an open addressing table of handles.
+// Entries and paths live in an arena, so the pointers to them (image render commands keep
+// one) stay valid while the registry grows.
+static ImageInfo **g_images = NULL;
+static int g_image_count = 0;
+static int g_images_capacity = 0;
+static int *g_image_slots = NULL;           // IMAGE_NONE for free slots
+static unsigned g_image_slots_capacity = 0; // power of two
+static Arena g_image_arena;
+
+static ImageLoader g_image_loader;
+static unsigned g_layout_serial = 0;    // identifies the layout asking for images
+static float g_block_distance = 0;      // of the block being laid out, from the viewport
+
+static size_t g_texture_memory = 0;     // taken by the loaded image textures
+static size_t g_texture_budget = (size_t)DEFAULT_TEXTURE_BUDGET_MB << 20;
+
+#define IMAGE_WIDTH_STEP 256 // requested widths are rounded up, so resizing rarely reloads
+
+// Decoded images waiting for their texture, copied in bands of rows. Uploading a big image at
+// once stalls the frame for as long as the driver takes to copy it.
+typedef struct {
+    DecodedImage decoded;
+    Texture2D texture;      // created with the first band
+    int uploaded_rows;
+} TextureUpload;
+
+static TextureUpload *g_texture_uploads = NULL;
+static int g_texture_upload_count = 0;
+static int g_texture_uploads_capacity = 0;
+
+#define TEXTURE_UPLOAD_BUDGET (4 << 20) // bytes copied to the GPU per frame
+
+// ---- Document -----
+
+static const MarkdownDocument *g_document = NULL;
+
+// Source of the document, reloaded on changes when watched
+static ViewerDocument *g_viewer_document = NULL;
+static FileWatcher g_watcher = { .fd = -1, .watch = -1 };
+
+// ---- Background parsing -----
+
+// Big documents are parsed by a worker thread while the window comes up, and the blocks are
+// shown as they get parsed. The tree arrays move while they grow, so the worker holds the lock
+// while parsing a chunk and the main thread while it walks the tree to build the layout.
+static pthread_mutex_t g_document_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t g_parse_thread;
+static bool g_parse_thread_running = false;
+static int g_parsing = 0;           // cleared by the worker when it is done (atomic)
+static int g_layout_waiting = 0;    // set while the main thread waits for the lock (atomic)
+static int g_stop_parsing = 0;      // set when the viewer closes before the end (atomic)
+static uint32_t g_parsed_chunks = 0; // published by the worker (atomic)
+static uint32_t g_drawn_chunks = 0;  // parsed chunks when the last layout was built
+
+#define PARSE_PROGRESS_HEIGHT 3
+
+// Tree being rendered, refreshed at the start of every layout pass
+static const MarkdownTree *g_tree = NULL;
+
+// ---- Viewport virtualization -----
+
+// Only the top-level blocks near the viewport are laid out. The rest of the document is
+// replaced by spacers, sized with the heights measured the last time each block was visible
+// (or an estimate if it never was).
+typedef struct {
+    float height;
+    bool measured; // false while the height is just an estimate
+} BlockExtent;
+
+static BlockExtent *g_block_extents = NULL;
+static int g_block_count = 0;
+static float g_block_extents_width = 0;
+static int g_block_extents_font_size = 0;
+
+// Visible range of blocks emitted by the last layout pass
+static int g_first_visible_block = 0;
+static int g_last_visible_block = -1;
+static int g_first_screen_block = 0; // first one on screen, what the scroll position anchors to
+
+#define VIEWPORT_PREFETCH_SCREENS 0.5f // extra margin laid out above and below the viewport
+
+// Long code blocks are virtualized too, line by line, using the code block line index. These
+// are the line ranges emitted by the last layout pass, checked once the layout is done. They
+// live in the frame arena, like the rest of the data of a layout.
+typedef struct {
+    NodeIndex node;
+    unsigned first_line;
+    unsigned end_line;
+} CodeBlockRange;
+
+static CodeBlockRange *g_code_block_ranges = NULL;
+static int g_code_block_range_count = 0;
+static int g_code_block_ranges_capacity = 0;
 
 // ---- List rendering -----
 
@@ -177,7 +366,7 @@ void init_resource_path(const char *app_root) {
 
 // --- TEXT MANIPULATION FUNCTIONS ---
 
-static inline Clay_String make_clay_string(char* text, long length) {
+static inline Clay_String make_clay_string(const char* text, long length) {
     return (Clay_String) {
         .isStaticallyAllocated = false,
         .length = length,
@@ -186,8 +375,7 @@ static inline Clay_String make_clay_string(char* text, long length) {
 }
 
 static inline Clay_String make_clay_string_copy(const char* text, size_t length) {
-    char* copy = malloc(length);
-    if (!copy) exit(1);
+    char* copy = arena_alloc(&g_frame_arena, length);
     memcpy(copy, text, length);
     return (Clay_String) {
         .isStaticallyAllocated = false,
@@ -196,163 +384,338 @@ static inline Clay_String make_clay_string_copy(const char* text, size_t length)
     };
 }
 
-static void ensure_temp_text_capacity(int needed_capacity) {
-    if (g_temp_text_capacity >= needed_capacity) {
-        return;
-    }
+// --- IMAGE LOADING FUNCTIONS ---
 
-    int new_capacity = g_temp_text_capacity ? g_temp_text_capacity * 2 :
-                       INITIAL_TEMP_TEXT_CAPACITY;
-    while (new_capacity < needed_capacity) {
-        new_capacity *= 2;
+// Slot of the path, either its handle or the free slot where it goes
+static int *image_slot(const char *path, unsigned path_size, uint64_t hash) {
+    unsigned mask = g_image_slots_capacity - 1;
+    unsigned slot = (unsigned)hash & mask;
+    while (g_image_slots[slot] != IMAGE_NONE) {
+        const ImageInfo *info = g_images[g_image_slots[slot]];
+        if (info->path_hash == hash && info->path_size == path_size
+                && memcmp(info->path, path, path_size) == 0) {
+            break;
+        }
+        slot = (slot + 1) & mask;
     }
-
-    g_temp_text_buffers = realloc(g_temp_text_buffers, new_capacity * sizeof(char*));
-    g_temp_text_capacity = new_capacity;
+    return &g_image_slots[slot];
 }
 
-static void push_temp_text_buffer(char* buffer) {
-    ensure_temp_text_capacity(g_temp_text_count + 1);
-    g_temp_text_buffers[g_temp_text_count++] = buffer;
+static void grow_image_slots(void) {
+    free(g_image_slots);
+    g_image_slots_capacity = g_image_slots_capacity ? g_image_slots_capacity * 2 : 64;
+    g_image_slots = malloc(g_image_slots_capacity * sizeof(int));
+    if (!g_image_slots) {
+        perror("Error allocating image registry");
+        exit(1);
+    }
+    for (unsigned i = 0; i < g_image_slots_capacity; i++) {
+        g_image_slots[i] = IMAGE_NONE;
+    }
+    for (int i = 0; i < g_image_count; i++) {
+        *image_slot(g_images[i]->path, g_images[i]->path_size, g_images[i]->path_hash) = i;
+    }
 }
 
-static void free_all_temp_text_buffers(void) {
-    for (int i = 0; i < g_temp_text_count; ++i) {
-        free(g_temp_text_buffers[i]);
+// Handle of the image at path, registering it the first time
+static int register_image(const char *path, unsigned path_size) {
+    if ((unsigned)(g_image_count + 1) * 2 > g_image_slots_capacity) {
+        grow_image_slots();
+    }
+    uint64_t hash = Raylib_HashText(path, path_size);
+    int *slot = image_slot(path, path_size, hash);
+    if (*slot != IMAGE_NONE) {
+        return *slot;
     }
-    g_temp_text_count = 0;
-}
 
-// --- IMAGE LOADING FUNCTIONS ---
+    if (g_image_count == g_images_capacity) {
+        g_images_capacity = g_images_capacity ? g_images_capacity * 2 : 64;
+        g_images = realloc(g_images, g_images_capacity * sizeof(ImageInfo*));
+        if (!g_images) {
+            perror("Error allocating image registry");
+            exit(1);
+        }
+    }
 
-void* load_image_async(void *args) {
-    int index = *(int*)args;
-    free(args);
+    ImageInfo *info = arena_alloc(&g_image_arena, sizeof(ImageInfo));
+    *info = (ImageInfo) {
+        .path = arena_strndup(&g_image_arena, path, path_size),
+        .path_size = path_size,
+        .path_hash = hash,
+        .state = IMAGE_IDLE,
+        .image = {0}
+    };
+    g_images[g_image_count] = info;
+    *slot = g_image_count;
+    return g_image_count++;
+}
 
-    Image image = {0};
-    bool is_image_loaded = false;
+// Image of the span, registered on its first layout. It is (re)queued for loading, nearer
+// images first, until it is loaded, and again if it is displayed wider than its texture.
+static ImageInfo *get_image(ImageDetail *detail, float display_width) {
+    if (detail->image == IMAGE_NONE) {
+        detail->image = register_image(detail->src.text, detail->src.size);
+    }
 
-    if (access(images[index].path, F_OK) == 0) {
-        image = LoadImage(images[index].path);
-        if (image.data) {
-            printf("Loaded image: '%.*s'\n", images[index].path_size, images[index].path);
-            is_image_loaded = true;
-        } else {
-            printf("Cannot load image (LoadImage failed): '%.*s'\n", images[index].path_size, images[index].path);
+    ImageInfo *info = g_images[detail->image];
+    info->last_used = g_layout_serial;
+    info->distance = g_block_distance;
+
+    int max_width = ((int)ceilf(display_width) + IMAGE_WIDTH_STEP - 1)
+                    / IMAGE_WIDTH_STEP * IMAGE_WIDTH_STEP;
+    bool too_small = info->state == IMAGE_LOADED && !info->keep_texture
+                     && info->image.width < info->width && info->image.width < display_width;
+
+    if (!info->uploading
+            && (info->state == IMAGE_IDLE || info->state == IMAGE_QUEUED || too_small)) {
+        image_loader_request(&g_image_loader, detail->image, info->path, g_block_distance,
+                             g_layout_serial, max_width);
+        if (info->state != IMAGE_LOADED) {
+            info->state = IMAGE_QUEUED;
         }
-    } else {
-        printf("Cannot load image: '%.*s'\n", images[index].path_size, images[index].path);
     }
+    return info;
+}
 
-    images[index].pending_image = image;
-    images[index].has_pending_image = true;
-    images[index].is_image_loaded = is_image_loaded;
+// GPU memory taken by a texture and its mipmaps
+static size_t texture_memory(Texture2D texture) {
+    size_t size = 0;
+    int width = texture.width;
+    int height = texture.height;
+    for (int level = 0; level < texture.mipmaps; level++) {
+        size += GetPixelDataSize(width, height, texture.format);
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+    }
+    return size;
+}
 
-    return NULL;
+static void unload_image_texture(ImageInfo *info) {
+    g_texture_memory -= texture_memory(info->image);
+    UnloadTexture(info->image);
+    info->image = (Texture2D) {0};
 }
 
-// Search for an image inside the images array, if not found, then loads it and returns the
-// pointer to that element.
-ImageInfo* find_or_load_image(const char *raw_path, unsigned path_size) {
-    // Copy image path
-    char path[512];
-    if (path_size >= sizeof(path)) {
-        fprintf(stderr, "Image URL too long\n");
+static int compare_last_used(const void *a, const void *b) {
+    unsigned last_a = (*(ImageInfo* const*)a)->last_used;
+    unsigned last_b = (*(ImageInfo* const*)b)->last_used;
+    return last_a < last_b ? -1 : last_a > last_b;
+}
+
+// Unloads the textures that the last layout did not use, least recently used first, until
+// the loaded ones fit in the budget. Those images are off-screen beyond the prefetch margin,
+// so the render commands do not reference them.
+static void evict_image_textures(void) {
+    if (g_texture_memory <= g_texture_budget) {
+        return;
+    }
+
+    ImageInfo **unused = malloc(g_image_count * sizeof(ImageInfo*));
+    if (!unused) {
+        perror("Error allocating image registry");
         exit(1);
     }
-    memcpy(path, raw_path, path_size);
-    path[path_size] = '\0';
+    int unused_count = 0;
+    for (int i = 0; i < g_image_count; i++) {
+        if (g_images[i]->state == IMAGE_LOADED && g_images[i]->last_used != g_layout_serial) {
+            unused[unused_count++] = g_images[i];
+        }
+    }
+    qsort(unused, unused_count, sizeof(ImageInfo*), compare_last_used);
 
-    // Search for the image if already loaded
-    for (int i = 0; i <= images_array_pointer; i++) {
-        if (strcmp(path, images[i].path) == 0) {
-            return &images[i];
+    for (int i = 0; i < unused_count && g_texture_memory > g_texture_budget; i++) {
+        unload_image_texture(unused[i]);
+        unused[i]->state = IMAGE_IDLE;
+    }
+    free(unused);
+}
+
+static void queue_texture_upload(DecodedImage decoded) {
+    if (g_texture_upload_count == g_texture_uploads_capacity) {
+        g_texture_uploads_capacity = g_texture_uploads_capacity ? g_texture_uploads_capacity * 2 : 16;
+        g_texture_uploads = realloc(g_texture_uploads,
+                                    g_texture_uploads_capacity * sizeof(TextureUpload));
+        if (!g_texture_uploads) {
+            perror("Error allocating texture uploads");
+            exit(1);
         }
     }
+    g_texture_uploads[g_texture_upload_count++] = (TextureUpload) {
+        .decoded = decoded,
+    };
+    g_images[decoded.id]->uploading = true;
+}
 
-    // Load the image inside the images array
-    images_array_pointer++;
-    if (images_array_pointer == 256) {
-        fprintf(stderr, "You have too many images inside this file.\n");
-        exit(1);
+// Images of the last layout first, nearest to the viewport first
+static int compare_upload_priority(const void *a, const void *b) {
+    const ImageInfo *info_a = g_images[((const TextureUpload*)a)->decoded.id];
+    const ImageInfo *info_b = g_images[((const TextureUpload*)b)->decoded.id];
+    bool shown_a = info_a->last_used == g_layout_serial;
+    bool shown_b = info_b->last_used == g_layout_serial;
+    if (shown_a != shown_b) {
+        return shown_a ? -1 : 1;
     }
+    return info_a->distance < info_b->distance ? -1 : info_a->distance > info_b->distance;
+}
 
-    // Path string duplicate
-    char *stored_path = strdup(path);
-    if (!stored_path) {
-        perror("Error duplicating image path str: strdup");
-        exit(1);
+// Copies the next band of rows that fits in the budget (at least one row), and takes it from
+// the budget. Returns true once the whole image is in the texture.
+static bool upload_texture_rows(TextureUpload *upload, size_t *budget) {
+    Image *pixels = &upload->decoded.image;
+
+    // Compressed images cannot be split in rows, and come with their own mipmaps
+    if (pixels->format >= PIXELFORMAT_COMPRESSED_DXT1_RGB) {
+        upload->texture = LoadTextureFromImage(*pixels);
+        *budget = 0;
+        return true;
     }
 
-    // Mark the image as not loaded, then tries to load it inside a new thread
-    images[images_array_pointer] = (ImageInfo) {
-        .path = stored_path,
-        .path_size = path_size,
-        .is_image_loaded = false,
-        .has_pending_image = false,
-        .pending_image = {0},
-        .image = {0}
-    };
+    if (upload->texture.id == 0) {
+        upload->texture = (Texture2D) {
+            .id = rlLoadTexture(NULL, pixels->width, pixels->height, pixels->format, 1),
+            .width = pixels->width,
+            .height = pixels->height,
+            .mipmaps = 1,
+            .format = pixels->format,
+        };
+    }
 
-    int *idx = malloc(sizeof(int));
-    *idx = images_array_pointer;
-    pthread_t thread_id;
-    int ret_val = pthread_create(&thread_id, NULL, load_image_async, idx);
-    if (ret_val != 0) {
-        fprintf(stderr, "Error creating thread: %d\n", ret_val);
-        exit(1);
+    size_t row_size = GetPixelDataSize(pixels->width, 1, pixels->format);
+    int rows = (int)(*budget / row_size);
+    int remaining = pixels->height - upload->uploaded_rows;
+    rows = rows < 1 ? 1 : (rows > remaining ? remaining : rows);
+
+    Rectangle band = { 0, (float)upload->uploaded_rows, (float)pixels->width, (float)rows };
+    UpdateTextureRec(upload->texture, band,
+                     (unsigned char*)pixels->data + upload->uploaded_rows * row_size);
+    upload->uploaded_rows += rows;
+
+    // Leftovers smaller than a row are not worth another band
+    if (upload->uploaded_rows < pixels->height) {
+        *budget = 0;
+        return false;
     }
+    *budget = rows * row_size < *budget ? *budget - rows * row_size : 0;
+    GenTextureMipmaps(&upload->texture);
+    SetTextureFilter(upload->texture, TEXTURE_FILTER_TRILINEAR);
+    return true;
+}
 
-    // Optional: detach so we don't leak threads
-    pthread_detach(thread_id);
+// Spends this frame's upload budget. Returns true if any image got its texture.
+static bool upload_textures(void) {
+    if (g_texture_upload_count == 0) {
+        return false;
+    }
+    qsort(g_texture_uploads, g_texture_upload_count, sizeof(TextureUpload),
+          compare_upload_priority);
+
+    bool finished = false;
+    size_t budget = TEXTURE_UPLOAD_BUDGET;
+    while (g_texture_upload_count > 0 && budget > 0) {
+        TextureUpload *upload = &g_texture_uploads[0];
+        if (!upload_texture_rows(upload, &budget)) {
+            continue;
+        }
 
-    return &images[images_array_pointer];
+        // A loaded image getting a bigger texture shows the old one until now
+        ImageInfo *info = g_images[upload->decoded.id];
+        if (info->state == IMAGE_LOADED) {
+            unload_image_texture(info);
+        }
+        info->image = upload->texture;
+        info->state = IMAGE_LOADED;
+        info->uploading = false;
+        g_texture_memory += texture_memory(info->image);
+        image_loader_release(&upload->decoded);
+        finished = true;
+
+        g_texture_upload_count--;
+        memmove(g_texture_uploads, g_texture_uploads + 1,
+                g_texture_upload_count * sizeof(TextureUpload));
+    }
+    return finished;
 }
 
-void update_pending_textures(void) {
-    for (int i = 0; i <= images_array_pointer; i++) {
-        if (images[i].has_pending_image) {
-            if (images[i].is_image_loaded) {
-                images[i].image = LoadTextureFromImage(images[i].pending_image);
-                UnloadImage(images[i].pending_image);
+// Picks up the images finished by the loader threads and uploads what fits in this frame.
+// Returns true if any image changed its state, so the caller knows the current layout is
+// outdated.
+bool update_pending_textures(void) {
+    bool updated = false;
+    DecodedImage decoded[16];
+    int count;
+    while ((count = image_loader_poll(&g_image_loader, decoded, 16)) > 0) {
+        for (int i = 0; i < count; i++) {
+            ImageInfo *info = g_images[decoded[i].id];
+            if (decoded[i].cancelled) {
+                // A loaded image waiting for a bigger texture keeps the one it has
+                if (info->state == IMAGE_QUEUED) {
+                    info->state = IMAGE_IDLE;
+                }
+                continue;
+            }
+            if (decoded[i].image.data) {
+                // The box of the image is laid out with its size while it uploads
+                updated |= info->width != decoded[i].source_width;
+                info->width = decoded[i].source_width;
+                info->height = decoded[i].source_height;
+                queue_texture_upload(decoded[i]);
+            } else if (info->state == IMAGE_LOADED) {
+                info->keep_texture = true;
+            } else {
+                info->state = IMAGE_FAILED;
+                updated = true;
             }
-            images[i].pending_image = (Image){0};
-            images[i].has_pending_image = false;
         }
     }
+
+    updated |= upload_textures();
+    return updated;
 }
 
-// Cleans the images array, unloading textures and temporary path strings.
+// Cleans the image registry, unloading the textures
 void clean_images_array() {
-    if (images_array_pointer < 0) {
-        return;
-    }
-    for (int i = 0; i <= images_array_pointer; i++) {
-        ImageInfo info = images[i];
-        if (info.is_image_loaded && info.image.id > 0) {
-            UnloadTexture(info.image);
+    for (int i = 0; i < g_texture_upload_count; i++) {
+        if (g_texture_uploads[i].texture.id > 0) {
+            UnloadTexture(g_texture_uploads[i].texture);
         }
-        if (info.path) {
-            free(info.path);
+        image_loader_release(&g_texture_uploads[i].decoded);
+    }
+    free(g_texture_uploads);
+    g_texture_uploads = NULL;
+    g_texture_upload_count = 0;
+    g_texture_uploads_capacity = 0;
+
+    for (int i = 0; i < g_image_count; i++) {
+        if (g_images[i]->state == IMAGE_LOADED && g_images[i]->image.id > 0) {
+            unload_image_texture(g_images[i]);
         }
     }
-    images_array_pointer = -1;
+    free(g_images);
+    free(g_image_slots);
+    arena_release(&g_image_arena);
+    g_images = NULL;
+    g_image_slots = NULL;
+    g_image_count = 0;
+    g_images_capacity = 0;
+    g_image_slots_capacity = 0;
+    g_texture_memory = 0;
+}
+
+void set_texture_budget(size_t megabytes) {
+    g_texture_budget = megabytes << 20;
 }
 
 // ============================================================================
 // TEXT RENDERING SYSTEM
 // ============================================================================
 
-static void textline_init(void) {
+static void textline_init(float max_width) {
     g_current_line.count = 0;
-    g_current_line.char_count = 0;
+    g_current_line.width = 0;
+    g_current_line.max_width = max_width;
 }
 
-static void textline_flush() {
-    if (g_current_line.count == 0) {
-        return;
-    }
-
+static void emit_text_line(const TextElement *elements, int count) {
     // Line container
     CLAY_AUTO_ID({
         .layout = {
@@ -363,265 +726,581 @@ static void textline_flush() {
         .backgroundColor = COLOR_BACKGROUND,
     }) {
         // render each text element
-        for (int i = 0; i < g_current_line.count; ++i) {
-            CLAY_TEXT(g_current_line.elements[i].string, g_current_line.elements[i].config);
+        for (int i = 0; i < count; ++i) {
+            CLAY_TEXT(elements[i].string, elements[i].config);
         }
     }
+}
+
+static void line_cache_record(const TextElement *elements, int count);
+
+static void textline_flush() {
+    if (g_current_line.count == 0) {
+        return;
+    }
+
+    emit_text_line(g_current_line.elements, g_current_line.count);
+    if (g_line_cache.recording) {
+        line_cache_record(g_current_line.elements, g_current_line.count);
+    }
 
     g_current_line.count = 0;
-    g_current_line.char_count = 0;
+    g_current_line.width = 0;
 }
 
+static void textline_append(const char* source, int length, float width,
+                            Clay_TextElementConfig* config) {
+    if (length <= 0) {
+        return;
+    }
+    // If line is full, flush before pushing more
+    if (g_current_line.count >= MAX_TEXT_ELEMENTS) {
+        textline_flush();
+    }
+
+    g_current_line.elements[g_current_line.count].string = make_clay_string(source, length);
+    g_current_line.elements[g_current_line.count].config = config;
+    g_current_line.count++;
+    g_current_line.width += width;
+}
+
+// Advance of a single codepoint, the same Raylib_MeasureText() adds up and the glyph run draws
+static float codepoint_advance(Clay_TextElementConfig *config, int codepoint) {
+    return Raylib_CodepointAdvance(g_fonts, config->fontId, codepoint, config->fontSize,
+                                   config->letterSpacing);
+}
+
+// Adds text to the current line, wrapping at spaces when it gets wider than the line. Words
+// wider than a whole line are split between codepoints, never inside a UTF-8 sequence.
+// Every codepoint is measured once, the text is walked a single time whatever its length.
+// Text of the document goes through textline_push_node(), which reuses the measured words.
 static void textline_push(const char* source, int length,
                           Clay_TextElementConfig* config) {
     // Disable clays text wrapping
     config->wrapMode = CLAY_TEXT_WRAP_NONE;
 
-    // If line is full, flush before pushing more
-    if (g_current_line.count >= MAX_TEXT_ELEMENTS) {
-        textline_flush();
+    int segment_start = 0;      // first byte not appended to a line yet
+    float width = 0;            // width of [segment_start, index)
+    int break_at = -1;          // byte right after the last space of the segment
+    float width_at_break = 0;   // width of [segment_start, break_at)
+
+    int index = 0;
+    while (index < length) {
+        int next = index;
+        int codepoint = GetNextUTF8Char(source, &next, length);
+        if (codepoint == -1) {
+            next = length; // Truncated sequence, keep it with the rest of the text
+        }
+        float advance = codepoint == -1 ? 0 : codepoint_advance(config, codepoint);
+
+        // Spaces may hang past the end of the line, the break goes right after them
+        bool line_empty = g_current_line.count == 0 && index == segment_start;
+        if (!line_empty && codepoint != ' '
+                && g_current_line.width + width + advance > g_current_line.max_width) {
+            if (break_at > segment_start) {
+                // Wrap after the last space, the rest of the segment starts the next line
+                textline_append(source + segment_start, break_at - segment_start, width_at_break,
+                                config);
+                textline_flush();
+                segment_start = break_at;
+                width -= width_at_break;
+                break_at = -1;
+            } else if (g_current_line.count > 0) {
+                // Try placing the word on a new line before splitting it
+                textline_flush();
+            } else {
+                // The word alone is wider than the line
+                textline_append(source + segment_start, index - segment_start, width, config);
+                textline_flush();
+                segment_start = index;
+                width = 0;
+            }
+            continue; // Measure the same codepoint against the new line
+        }
+
+        width += advance;
+        index = next;
+        if (codepoint == ' ') {
+            break_at = index;
+            width_at_break = width;
+        }
     }
 
-    int remaining = g_available_characters - g_current_line.char_count;
+    textline_append(source + segment_start, length - segment_start, width, config);
+}
 
-    // Check if adding this text exceeds max characters allowed
-    if (g_current_line.char_count + length > g_available_characters) {
-        // Find last space within the allowed range to wrap
-        int wrap_pos = -1;
-        int max_len = remaining;
-        for (int i = max_len; i > 0; i--) {
-            if (source[i-1] == ' ') {
-                wrap_pos = i;
-                break;
-            }
+// --- Line break cache ---
+
+static void *grow_array(void *array, unsigned *capacity, unsigned needed, size_t item_size) {
+    if (*capacity >= needed) {
+        return array;
+    }
+    unsigned new_capacity = *capacity ? *capacity * 2 : 1024;
+    while (new_capacity < needed) {
+        new_capacity *= 2;
+    }
+    array = realloc(array, new_capacity * item_size);
+    if (!array) {
+        perror("Error allocating line cache");
+        exit(1);
+    }
+    *capacity = new_capacity;
+    return array;
+}
+
+static void line_cache_clear(void) {
+    for (unsigned i = 0; i < g_line_cache.capacity; i++) {
+        g_line_cache.entries[i].node = NODE_NONE;
+    }
+    g_line_cache.count = 0;
+    g_line_cache.element_count = 0;
+    g_line_cache.line_count = 0;
+}
+
+static void line_cache_release(void) {
+    free(g_line_cache.entries);
+    free(g_line_cache.elements);
+    free(g_line_cache.line_lengths);
+    g_line_cache = (LineCache) {0};
+}
+
+// Slot of the node, either its entry or the free slot where it goes
+static LineCacheEntry *line_cache_slot(NodeIndex node) {
+    unsigned mask = g_line_cache.capacity - 1;
+    unsigned slot = (node * 2654435761u) & mask;
+    while (g_line_cache.entries[slot].node != NODE_NONE
+            && g_line_cache.entries[slot].node != node) {
+        slot = (slot + 1) & mask;
+    }
+    return &g_line_cache.entries[slot];
+}
+
+static void line_cache_grow_table(void) {
+    LineCacheEntry *old_entries = g_line_cache.entries;
+    unsigned old_capacity = g_line_cache.capacity;
+
+    g_line_cache.capacity = old_capacity ? old_capacity * 2 : 256;
+    g_line_cache.entries = malloc(g_line_cache.capacity * sizeof(LineCacheEntry));
+    if (!g_line_cache.entries) {
+        perror("Error allocating line cache");
+        exit(1);
+    }
+    for (unsigned i = 0; i < g_line_cache.capacity; i++) {
+        g_line_cache.entries[i].node = NODE_NONE;
+    }
+    for (unsigned i = 0; i < old_capacity; i++) {
+        if (old_entries[i].node != NODE_NONE) {
+            *line_cache_slot(old_entries[i].node) = old_entries[i];
         }
+    }
+    free(old_entries);
+}
 
-        // If there is no space and before wrapping in the middle of a word, try placing the
-        // entire chunk on a new line (only works if it fits in an empty line).
-        if (wrap_pos == -1 && length <= g_available_characters) {
-            textline_flush();
-            textline_push(source, length, config);
-            return;
+static const LineCacheEntry *line_cache_find(NodeIndex node, float width) {
+    if (g_line_cache.count == 0) {
+        return NULL;
+    }
+    const LineCacheEntry *entry = line_cache_slot(node);
+    if (entry->node == NODE_NONE || entry->width != width
+            || entry->font_size != g_base_font_size) {
+        return NULL;
+    }
+    return entry;
+}
+
+static void line_cache_record(const TextElement *elements, int count) {
+    LineCache *cache = &g_line_cache;
+    cache->elements = grow_array(cache->elements, &cache->elements_capacity,
+                                 cache->element_count + count, sizeof(TextElement));
+    memcpy(cache->elements + cache->element_count, elements, count * sizeof(TextElement));
+    cache->element_count += count;
+
+    cache->line_lengths = grow_array(cache->line_lengths, &cache->lines_capacity,
+                                     cache->line_count + 1, sizeof(unsigned));
+    cache->line_lengths[cache->line_count++] = count;
+}
+
+static void line_cache_begin(void) {
+    if (g_line_cache.element_count > LINE_CACHE_MAX_ELEMENTS) {
+        line_cache_clear();
+    }
+    g_line_cache.recording = true;
+}
+
+// Stores the lines recorded since line_cache_begin() as the layout of the node
+static void line_cache_end(NodeIndex node, float width, uint32_t first_element,
+                           uint32_t first_line) {
+    g_line_cache.recording = false;
+
+    if ((g_line_cache.count + 1) * 2 > g_line_cache.capacity) {
+        line_cache_grow_table();
+    }
+    LineCacheEntry *entry = line_cache_slot(node);
+    if (entry->node == NODE_NONE) {
+        g_line_cache.count++;
+    }
+    *entry = (LineCacheEntry) {
+        .node = node,
+        .width = width,
+        .font_size = g_base_font_size,
+        .first_element = first_element,
+        .first_line = first_line,
+        .line_count = g_line_cache.line_count - first_line,
+    };
+}
+
+static void line_cache_replay(const LineCacheEntry *entry) {
+    const TextElement *elements = g_line_cache.elements + entry->first_element;
+    for (uint32_t i = 0; i < entry->line_count; i++) {
+        unsigned count = g_line_cache.line_lengths[entry->first_line + i];
+        emit_text_line(elements, count);
+        elements += count;
+    }
+}
+
+// --- Word cache ---
+
+static void word_cache_clear(void) {
+    for (unsigned i = 0; i < g_word_cache.capacity; i++) {
+        g_word_cache.entries[i].node = NODE_NONE;
+    }
+    g_word_cache.count = 0;
+    g_word_cache.word_count = 0;
+}
+
+static void word_cache_release(void) {
+    free(g_word_cache.entries);
+    free(g_word_cache.words);
+    g_word_cache = (WordCache) {0};
+}
+
+static WordCacheEntry *word_cache_slot(NodeIndex node) {
+    unsigned mask = g_word_cache.capacity - 1;
+    unsigned slot = (node * 2654435761u) & mask;
+    while (g_word_cache.entries[slot].node != NODE_NONE
+            && g_word_cache.entries[slot].node != node) {
+        slot = (slot + 1) & mask;
+    }
+    return &g_word_cache.entries[slot];
+}
+
+static void word_cache_grow_table(void) {
+    WordCacheEntry *old_entries = g_word_cache.entries;
+    unsigned old_capacity = g_word_cache.capacity;
+
+    g_word_cache.capacity = old_capacity ? old_capacity * 2 : 256;
+    g_word_cache.entries = malloc(g_word_cache.capacity * sizeof(WordCacheEntry));
+    if (!g_word_cache.entries) {
+        perror("Error allocating word cache");
+        exit(1);
+    }
+    for (unsigned i = 0; i < g_word_cache.capacity; i++) {
+        g_word_cache.entries[i].node = NODE_NONE;
+    }
+    for (unsigned i = 0; i < old_capacity; i++) {
+        if (old_entries[i].node != NODE_NONE) {
+            *word_cache_slot(old_entries[i].node) = old_entries[i];
         }
+    }
+    free(old_entries);
+}
 
-        // If no space found and it cannot be place onto a new line, just break at max_len
-        if (wrap_pos == -1) {
-            wrap_pos = max_len;
+// Splits the text into words and measures them, with the same advances as textline_push()
+static void measure_words(const char *source, int length, Clay_TextElementConfig *config) {
+    WordCache *cache = &g_word_cache;
+    TextWord word = { .spaces_only = true };
+    bool in_spaces = false;
+    int index = 0;
+    while (index < length) {
+        int next = index;
+        int codepoint = GetNextUTF8Char(source, &next, length);
+        if (codepoint == -1) {
+            next = length; // Truncated sequence, keep it with the rest of the text
         }
 
-        // Push first part
-        textline_push(source, wrap_pos, config);
-        textline_flush();
+        // A word starting after spaces closes the previous one
+        if (in_spaces && codepoint != ' ') {
+            cache->words = grow_array(cache->words, &cache->words_capacity,
+                                      cache->word_count + 1, sizeof(TextWord));
+            cache->words[cache->word_count++] = word;
+            word.width = 0;
+            word.content_width = 0;
+            word.spaces_only = true;
+            in_spaces = false;
+        }
 
-        // Push remainder recursively (skip space if any)
-        int remainder_start = wrap_pos;
-        while (remainder_start < length && source[remainder_start] == ' ') {
-            remainder_start++;
+        word.width += codepoint == -1 ? 0 : codepoint_advance(config, codepoint);
+        if (codepoint == ' ') {
+            in_spaces = true;
+        } else {
+            word.content_width = word.width;
+            word.spaces_only = false;
         }
-        if (remainder_start < length) {
-            textline_push(source + remainder_start, length - remainder_start, config);
+        word.end = next;
+        index = next;
+    }
+
+    if (length > 0) {
+        cache->words = grow_array(cache->words, &cache->words_capacity,
+                                  cache->word_count + 1, sizeof(TextWord));
+        cache->words[cache->word_count++] = word;
+    }
+}
+
+// Words of a text node in the given font, measured the first time they are asked for
+static const WordCacheEntry *word_cache_get(NodeIndex node, const char *source, int length,
+                                            Clay_TextElementConfig *config) {
+    WordCache *cache = &g_word_cache;
+    if (cache->count > 0) {
+        const WordCacheEntry *entry = word_cache_slot(node);
+        if (entry->node == node && entry->font_id == config->fontId
+                && entry->font_size == config->fontSize
+                && entry->letter_spacing == config->letterSpacing) {
+            return entry;
         }
-        return;
     }
 
-    // Normal push if space is available
-    char* buffer = malloc(length + 1);
-    memcpy(buffer, source, length);
-    buffer[length] = '\0';
-    push_temp_text_buffer(buffer);
+    if (cache->word_count > WORD_CACHE_MAX_WORDS) {
+        word_cache_clear();
+    }
+    if ((cache->count + 1) * 2 > cache->capacity) {
+        word_cache_grow_table();
+    }
+
+    uint32_t first_word = cache->word_count;
+    measure_words(source, length, config);
 
-    g_current_line.elements[g_current_line.count].string = make_clay_string(buffer, length);
-    g_current_line.elements[g_current_line.count].config = config;
-    g_current_line.count++;
-    g_current_line.char_count += length;
+    WordCacheEntry *entry = word_cache_slot(node);
+    if (entry->node == NODE_NONE) {
+        cache->count++;
+    }
+    *entry = (WordCacheEntry) {
+        .node = node,
+        .font_id = config->fontId,
+        .font_size = config->fontSize,
+        .letter_spacing = config->letterSpacing,
+        .first_word = first_word,
+        .word_count = cache->word_count - first_word,
+    };
+    return entry;
+}
 
-    // Flush if reached limit exactly
-    if (g_current_line.char_count >= g_available_characters) {
-        textline_flush();
+// Same line breaking as textline_push(), a word at a time. Only words wider than a whole line
+// are walked again, to split them between codepoints.
+static void textline_push_node(NodeIndex node, const char *source, int length,
+                               Clay_TextElementConfig *config) {
+    config->wrapMode = CLAY_TEXT_WRAP_NONE;
+
+    const WordCacheEntry *entry = word_cache_get(node, source, length, config);
+    const TextWord *words = g_word_cache.words + entry->first_word;
+
+    int segment_start = 0;      // first byte not appended to a line yet
+    float width = 0;            // width of [segment_start, start of the word)
+    int start = 0;
+    for (uint32_t i = 0; i < entry->word_count; ) {
+        const TextWord *word = &words[i];
+        if (word->spaces_only
+                || g_current_line.width + width + word->content_width <= g_current_line.max_width) {
+            width += word->width;
+            start = word->end;
+            i++;
+        } else if (start > segment_start) {
+            // Wrap before the word, it starts the next line
+            textline_append(source + segment_start, start - segment_start, width, config);
+            textline_flush();
+            segment_start = start;
+            width = 0;
+        } else if (g_current_line.count > 0) {
+            // Try placing the word on a new line before splitting it
+            textline_flush();
+        } else {
+            // The word alone is wider than the line
+            textline_push(source + start, word->end - start, config);
+            segment_start = word->end;
+            start = word->end;
+            i++;
+        }
     }
+
+    textline_append(source + segment_start, length - segment_start, width, config);
 }
 
 // ============================================================================
 // FONT MANAGEMENT
 // ============================================================================
 
-typedef struct {
-    int start;
-    int end;
-} CodepointRange;
+static int ready_font(FontId font_id);
 
 static void reset_font_styles(void) {
+    Raylib_SetEmojiFont(ready_font(FONT_ID_EMOJI));
+
     g_font_body_regular = (Clay_TextElementConfig) {
-        .fontId = FONT_ID_REGULAR,
+        .fontId = ready_font(FONT_ID_REGULAR),
         .fontSize = g_base_font_size,
         .textColor = COLOR_FOREGROUND
     };
 
     g_font_body_italic = (Clay_TextElementConfig) {
-        .fontId = FONT_ID_ITALIC,
+        .fontId = ready_font(FONT_ID_ITALIC),
         .fontSize = g_base_font_size,
         .textColor = COLOR_FOREGROUND
     };
 
     g_font_body_bold = (Clay_TextElementConfig) {
-        .fontId = FONT_ID_BOLD,
+        .fontId = ready_font(FONT_ID_BOLD),
         .fontSize = g_base_font_size,
         .textColor = COLOR_FOREGROUND
     };
 
     g_font_h1 = (Clay_TextElementConfig) {
-        .fontId = FONT_ID_EXTRABOLD,
+        .fontId = ready_font(FONT_ID_EXTRABOLD),
         .fontSize = g_base_font_size + 14,
         .textColor = COLOR_FOREGROUND
     };
 
     g_font_h2 = (Clay_TextElementConfig) {
-        .fontId = FONT_ID_EXTRABOLD,
+        .fontId = ready_font(FONT_ID_EXTRABOLD),
         .fontSize = g_base_font_size + 12,
         .textColor = COLOR_FOREGROUND
     };
 
     g_font_h3 = (Clay_TextElementConfig) {
-        .fontId = FONT_ID_EXTRABOLD,
+        .fontId = ready_font(FONT_ID_EXTRABOLD),
         .fontSize = g_base_font_size + 6,
         .textColor = COLOR_FOREGROUND
     };
 
     g_font_h4 = (Clay_TextElementConfig) {
-        .fontId = FONT_ID_BOLD,
+        .fontId = ready_font(FONT_ID_BOLD),
         .fontSize = g_base_font_size + 4,
         .textColor = COLOR_FOREGROUND
     };
 
     g_font_h5 = (Clay_TextElementConfig) {
-        .fontId = FONT_ID_ITALIC,
+        .fontId = ready_font(FONT_ID_ITALIC),
         .fontSize = g_base_font_size + 2,
         .textColor = COLOR_FOREGROUND
     };
 
     g_font_inline_code = (Clay_TextElementConfig) {
-        .fontId = FONT_ID_REGULAR,
+        .fontId = ready_font(FONT_ID_REGULAR),
         .fontSize = g_base_font_size,
         .textColor = COLOR_BLUE
     };
+
+    // Fixed line height, so empty lines keep their size and code blocks can be virtualized
+    g_font_code_block = (Clay_TextElementConfig) {
+        .fontId = ready_font(FONT_ID_REGULAR),
+        .fontSize = g_base_font_size,
+        .lineHeight = g_base_font_size,
+        .textColor = COLOR_FOREGROUND,
+        .wrapMode = CLAY_TEXT_WRAP_NONE
+    };
 }
 
-static void load_font_with_ranges(int font_id, const char* font_path,
-                                  const CodepointRange* ranges,
-                                  int range_count,
-                                  const int* additional_codepoints,
-                                  int additional_count) {
-    FT_Face face;
-    FT_New_Face(g_freetype_lib, font_path, 0, &face);
+// Glyphs are rasterized the first time some text uses them, see glyph_atlas.h
+static int load_glyph(int font_id, int codepoint) {
+    int glyph = glyph_atlas_add(&g_glyph_atlases[font_id], codepoint);
+    g_fonts[font_id] = g_glyph_atlases[font_id].font;
+    return glyph;
+}
 
-    int pixel_size = g_base_font_size * FONT_SCALE_FACTOR;
-    FT_Set_Pixel_Sizes(face, 0, pixel_size);
+static void *load_font_async(void *arg) {
+    FontLoad *load = arg;
+    int font_id = (int)(load - g_font_loads);
+    load->loaded = glyph_atlas_load(&g_glyph_atlases[font_id], g_freetype_lib, load->path,
+                                    load->pixel_size, load->sdf);
+    __atomic_store_n(&load->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
 
-    int max_codepoint_count = 0;
-    for (int i = 0; i < range_count; i++) {
-        max_codepoint_count += (ranges[i].end - ranges[i].start + 1);
+// Waits for the worker of the face if needed, then uploads its atlas
+static void finish_font_load(int font_id) {
+    FontLoad *load = &g_font_loads[font_id];
+    if (load->running) {
+        pthread_join(load->thread, NULL);
+        load->running = false;
     }
-    max_codepoint_count += additional_count;
-
-    int* codepoints = malloc(sizeof(int) * max_codepoint_count);
-    int valid_count = 0;
-
-    for (int i = 0; i < range_count; i++) {
-        for (int codepoint = ranges[i].start; codepoint <= ranges[i].end; codepoint++) {
-            if (FT_Get_Char_Index(face, codepoint)) {
-                codepoints[valid_count++] = codepoint;
-            }
-        }
+    if (g_font_ready[font_id]) {
+        return;
     }
 
-    for (int i = 0; i < additional_count; i++) {
-        int codepoint = additional_codepoints[i];
-        if (FT_Get_Char_Index(face, codepoint)) {
-            int is_duplicate = 0;
-            for (int j = 0; j < valid_count; j++) {
-                if (codepoints[j] == codepoint) {
-                    is_duplicate = 1;
-                    break;
-                }
-            }
-
-            if (!is_duplicate) {
-                codepoints[valid_count++] = codepoint;
-            }
-        }
+    if (load->loaded) {
+        glyph_atlas_upload(&g_glyph_atlases[font_id]);
+        g_fonts[font_id] = g_glyph_atlases[font_id].font;
+        Raylib_CreateLazyGlyphTable(font_id, &g_fonts[font_id], load_glyph);
+    } else {
+        g_fonts[font_id] = GetFontDefault();
     }
-
-    g_fonts[font_id] = LoadFontEx(font_path, pixel_size, codepoints, valid_count);
-
-    free(codepoints);
-    FT_Done_Face(face);
-
-    SetTextureFilter(g_fonts[font_id].texture, TEXTURE_FILTER_BILINEAR);
+    g_font_ready[font_id] = true;
 }
 
-static void load_emoji_font(int font_id, const char* font_path) {
-    static const CodepointRange emoji_ranges[] = {
-        {0x1F300, 0x1F5FF}, // Miscellaneous and Pictographs: objects, nature, and symbols
-        {0x1F600, 0x1F64F}, // Facial expressions and human emotions
-        {0x1F680, 0x1F6FF}, // Transport and Map Symbols
-        {0x1F700, 0x1F77F}, // Alchemical Symbols
-        {0x1F780, 0x1F7FF}, // Geometric Shapes Extended
-        {0x1F800, 0x1F8FF}, // Supplemental Arrows
-        {0x1F900, 0x1F9FF}, // Supplemental Symbols and Pictographs
-        {0x1FA00, 0x1FAFF}, // Symbols and Pictographs Extended-A
-        {0x2600,  0x26FF},  // More miscellaneous Symbols (like weather)
-        {0x2700,  0x27BF},  // Decorative marks and bullet-like symbols
-        {0x25A0,  0x25FF},  // Geometric Shapes
-        {0x2B50,  0x2B55},  // More miscellaneous symbols and arrows
-        {0x1F536, 0x1F53F}, // Colored geometric shapes
-        {0x1F7E0, 0x1F7EB}, // Geometric Shapes Extended subset
-    };
+static void start_font_load(int font_id, const char *file_name, bool sdf) {
+    FontLoad *load = &g_font_loads[font_id];
+    snprintf(load->path, sizeof(load->path), "%s/%s", g_resource_path, file_name);
+    load->pixel_size = g_base_font_size * FONT_SCALE_FACTOR;
+    load->sdf = sdf;
 
-    load_font_with_ranges(font_id, font_path,
-                          emoji_ranges,
-                          sizeof(emoji_ranges) / sizeof(emoji_ranges[0]),
-                          NULL, 0);
+    if (pthread_create(&load->thread, NULL, load_font_async, load) != 0) {
+        // No thread to spare, load the face right away
+        load_font_async(load);
+        finish_font_load(font_id);
+        return;
+    }
+    load->running = true;
 }
 
-static void load_standard_font(int font_id, const char* font_path) {
-    static const CodepointRange latin_ranges[] = {
-        {0x0020, 0x007E},   // ASCII
-        {0x00A0, 0x00FF},   // Latin-1 Supplement
-        {0x0100, 0x017F},   // Latin Extended-A
-        {0x0180, 0x024F},   // Latin Extended-B
-        {0x2000, 0x206F},   // List bullet points
-    };
+// Face to draw a style with right now
+static int ready_font(FontId font_id) {
+    return g_font_ready[font_id] ? (int)font_id : FONT_ID_REGULAR;
+}
 
-    static const int special_codepoints[] = {
-        0x00E1, 0x00E9, 0x00ED, 0x00F3, 0x00FA, 0x00F1,  // Lowercase
-        0x00C1, 0x00C9, 0x00CD, 0x00D3, 0x00DA, 0x00D1   // Uppercase
-    };
+static void invalidate_text_layout(void);
 
-    load_font_with_ranges(font_id, font_path,
-                          latin_ranges,
-                          sizeof(latin_ranges) / sizeof(latin_ranges[0]),
-                          special_codepoints,
-                          sizeof(special_codepoints) / sizeof(special_codepoints[0]));
+// Returns true if faces became ready since the last frame, the text is laid out again with them
+static bool update_font_loading(void) {
+    bool finished = false;
+    for (int i = 0; i < FONT_COUNT; i++) {
+        if (g_font_loads[i].running && __atomic_load_n(&g_font_loads[i].done, __ATOMIC_ACQUIRE)) {
+            finish_font_load(i);
+            finished = true;
+        }
+    }
+    if (finished) {
+        reset_font_styles();
+        invalidate_text_layout();
+    }
+    return finished;
 }
 
+static void wait_for_fonts(void) {
+    for (int i = 0; i < FONT_COUNT; i++) {
+        if (g_font_loads[i].running) {
+            pthread_join(g_font_loads[i].thread, NULL);
+            g_font_loads[i].running = false;
+        }
+    }
+}
 
 static void load_fonts(void) {
-    char path[PATH_MAX];
+    static const char *font_files[FONT_COUNT] = {
+        [FONT_ID_REGULAR] = "NotoSans-Regular.ttf",
+        [FONT_ID_ITALIC] = "NotoSans-Italic.ttf",
+        [FONT_ID_SEMIBOLD] = "NotoSans-SemiBold.ttf",
+        [FONT_ID_SEMIBOLD_ITALIC] = "NotoSans-SemiBoldItalic.ttf",
+        [FONT_ID_BOLD] = "NotoSans-Bold.ttf",
+        [FONT_ID_EXTRABOLD] = "NotoSans-ExtraBold.ttf",
+        [FONT_ID_EMOJI] = "NotoEmoji-Regular.ttf",
+    };
+
+    // Distance field glyphs stay sharp at every zoom level, coverage is the fallback for
+    // drivers that cannot compile the shader
+    bool sdf = Raylib_LoadSdfShader();
 
-    snprintf(path, sizeof(path), "%s/NotoSans-Regular.ttf", g_resource_path);
-    load_standard_font(FONT_ID_REGULAR, path);
-    snprintf(path, sizeof(path), "%s/NotoSans-Italic.ttf", g_resource_path);
-    load_standard_font(FONT_ID_ITALIC, path);
-    snprintf(path, sizeof(path), "%s/NotoSans-SemiBold.ttf", g_resource_path);
-    load_standard_font(FONT_ID_SEMIBOLD, path);
-    snprintf(path, sizeof(path), "%s/NotoSans-SemiBoldItalic.ttf", g_resource_path);
-    load_standard_font(FONT_ID_SEMIBOLD_ITALIC, path);
-    snprintf(path, sizeof(path), "%s/NotoSans-Bold.ttf", g_resource_path);
-    load_standard_font(FONT_ID_BOLD, path);
-    snprintf(path, sizeof(path), "%s/NotoSans-ExtraBold.ttf", g_resource_path);
-    load_standard_font(FONT_ID_EXTRABOLD, path);
-    snprintf(path, sizeof(path), "%s/NotoEmoji-Regular.ttf", g_resource_path);
-    load_emoji_font(FONT_ID_EMOJI, path);
+    for (int i = 0; i < FONT_COUNT; i++) {
+        start_font_load(i, font_files[i], sdf);
+    }
+    finish_font_load(FONT_ID_REGULAR);
 
     Clay_SetMeasureTextFunction(Raylib_MeasureText, g_fonts);
     reset_font_styles();
@@ -685,24 +1364,43 @@ static void initialize_clay(void) {
 // NODE RENDERING FUNCTIONS
 // ============================================================================
 
-static void render_node(MarkdownNode* current_node, float available_width);
+static void render_node(NodeIndex current_node, float available_width);
+
+// Empty element standing in for content that is not laid out
+static void render_spacer(float height) {
+    if (height <= 0) {
+        return;
+    }
+    CLAY_AUTO_ID({
+        .layout = {
+            .sizing = { .width = CLAY_SIZING_GROW(0), .height = CLAY_SIZING_FIXED(height) }
+        },
+    }) {};
+}
+
 
-static void render_text_node(MarkdownNode* node, float available_width) {
+static void render_text_node(NodeIndex node, float available_width) {
     const char* text = NULL;
     int length = 0;
     Clay_TextElementConfig* config = &g_font_body_regular;
 
-    switch (node->type) {
-    case NODE_TEXT:
-        if (node->value.text.type == MD_TEXT_SOFTBR) {
+    switch (node_type(g_tree, node)) {
+    case NODE_TEXT: {
+        const TextNode *text_node = node_text(g_tree, node);
+        if (text_node->type == MD_TEXT_SOFTBR) {
             textline_push(" ", 1, &g_font_body_regular);
         }
-        text = node->value.text.text;
-        length = node->value.text.size;
+        if (text_node->type == MD_TEXT_BR) {
+            textline_flush(); // Hard line break
+            return;
+        }
+        text = text_node->text;
+        length = text_node->size;
         break;
+    }
 
-    case NODE_SPAN:
-        switch (node->value.span.type) {
+    case NODE_SPAN: {
+        switch (node_span(g_tree, node)->type) {
         case MD_SPAN_EM:
             config = &g_font_body_italic;
             break;
@@ -719,26 +1417,32 @@ static void render_text_node(MarkdownNode* node, float available_width) {
             return;
         }
 
-        if (node->first_child && node->first_child->type == NODE_TEXT) {
-            text = node->first_child->value.text.text;
-            length = node->first_child->value.text.size;
+        NodeIndex child = node_first_child(g_tree, node);
+        if (child != NODE_NONE && node_type(g_tree, child) == NODE_TEXT) {
+            text = node_text(g_tree, child)->text;
+            length = node_text(g_tree, child)->size;
         } else {
             return;
         }
         break;
+    }
 
     default:
         return;
     }
 
-    textline_push(text, length, config);
+    textline_push_node(node, text, length, config);
 }
 
-static void render_heading(MarkdownNode* node, float available_width) {
-    MD_BLOCK_H_DETAIL* detail = (MD_BLOCK_H_DETAIL*) node->value.block.detail;
+static void render_heading(NodeIndex node, float available_width) {
+    MD_BLOCK_H_DETAIL* detail = (MD_BLOCK_H_DETAIL*) node_block(g_tree, node)->detail;
     unsigned int level = detail->level;
-    char* text = node->first_child->value.text.text;
-    int size = node->first_child->value.text.size;
+    if (node_first_child(g_tree, node) == NODE_NONE) {
+        return; // Empty heading
+    }
+    const TextNode* text_node = node_text(g_tree, node_first_child(g_tree, node));
+    const char* text = text_node->text;
+    int size = text_node->size;
 
     Clay_TextElementConfig* config = NULL;
     switch (level) {
@@ -782,17 +1486,58 @@ static void render_horizontal_rule(float available_width) {
     }) {};
 }
 
-static void render_code_block(MarkdownNode* node, float available_width) {
-    const float padding_top = 16;
-    const float padding_right = 16;
-    const float padding_bottom = 16;
-    const float padding_left = 16;
+#define CODE_BLOCK_PADDING 16
+
+// Lines of a code block that intersect the viewport (plus the prefetch margin), given the
+// screen position of its first line.
+static void get_visible_code_lines(float lines_top, unsigned line_count,
+                                   unsigned *first_line, unsigned *end_line) {
+    float line_height = g_font_code_block.lineHeight;
+    float margin = GetScreenHeight() * VIEWPORT_PREFETCH_SCREENS;
+    float first = (-margin - lines_top) / line_height;
+    float end = (GetScreenHeight() + margin - lines_top) / line_height + 1;
+
+    *first_line = first <= 0 ? 0 : (first >= line_count ? line_count : (unsigned)first);
+    *end_line = end <= 0 ? 0 : (end >= line_count ? line_count : (unsigned)end);
+    if (*end_line < *first_line) {
+        *end_line = *first_line;
+    }
+}
 
-    CLAY_AUTO_ID({
+static void render_code_block(NodeIndex node, float available_width) {
+    const CodeBlockDetail* detail = (const CodeBlockDetail*) node_block(g_tree, node)->detail;
+    const TextNode* code = node_text(g_tree, node_first_child(g_tree, node));
+    Clay_ElementId id = CLAY_IDI("code_block", node);
+    float line_height = g_font_code_block.lineHeight;
+
+    // Pick the lines to emit from where the block was in the previous layout. If that turns
+    // out to be wrong, check_code_block_ranges() asks for another pass.
+    Clay_ElementData previous = Clay_GetElementData(id);
+    float lines_top = previous.found ? previous.boundingBox.y + CODE_BLOCK_PADDING : 0;
+    unsigned first_line, end_line;
+    get_visible_code_lines(lines_top, detail->line_count, &first_line, &end_line);
+
+    if (g_code_block_range_count == g_code_block_ranges_capacity) {
+        int capacity = g_code_block_ranges_capacity ? g_code_block_ranges_capacity * 2 : 64;
+        CodeBlockRange *ranges = arena_alloc(&g_frame_arena, capacity * sizeof(CodeBlockRange));
+        if (g_code_block_range_count > 0) {
+            memcpy(ranges, g_code_block_ranges,
+                   g_code_block_range_count * sizeof(CodeBlockRange));
+        }
+        g_code_block_ranges = ranges;
+        g_code_block_ranges_capacity = capacity;
+    }
+    g_code_block_ranges[g_code_block_range_count++] = (CodeBlockRange) {
+        .node = node, .first_line = first_line, .end_line = end_line
+    };
+
+    // Grow to the full width, otherwise the block width would change with the lines that
+    // happen to be emitted.
+    CLAY(id, {
         .layout = {
             .layoutDirection = CLAY_TOP_TO_BOTTOM,
-            .sizing = { .width = CLAY_SIZING_FIT(0, available_width) },
-            .padding = { padding_top, padding_right, padding_bottom, padding_left }
+            .sizing = { .width = CLAY_SIZING_GROW(0, available_width) },
+            .padding = CLAY_PADDING_ALL(CODE_BLOCK_PADDING)
         },
         .cornerRadius = 4,
         .backgroundColor = COLOR_DIM,
@@ -802,16 +1547,46 @@ static void render_code_block(MarkdownNode* node, float available_width) {
             .childOffset = Clay_GetScrollOffset()
         }
     }) {
-        for (MarkdownNode* child = node->first_child; child; child = child->next_sibling) {
-            CLAY_TEXT(
-                make_clay_string(child->value.text.text, child->value.text.size),
-                &g_font_body_regular
-            );
+        render_spacer(first_line * line_height);
+
+        for (unsigned line = first_line; line < end_line; line++) {
+            unsigned start = detail->line_offsets[line];
+            unsigned end = line + 1 < detail->line_count ? detail->line_offsets[line + 1] :
+                           code->size;
+            if (end > start && code->text[end - 1] == '\n') {
+                end--;
+            }
+            CLAY_TEXT(make_clay_string(code->text + start, end - start), &g_font_code_block);
         }
+
+        render_spacer((detail->line_count - end_line) * line_height);
     };
 }
 
-static void render_quote_block(MarkdownNode* node, float available_width) {
+// Returns true if a code block emitted fewer lines than it needs at its final position.
+static bool check_code_block_ranges(void) {
+    bool incomplete = false;
+    for (int i = 0; i < g_code_block_range_count; i++) {
+        CodeBlockRange *range = &g_code_block_ranges[i];
+        const CodeBlockDetail* detail = (const CodeBlockDetail*)
+                                        node_block(g_tree, range->node)->detail;
+
+        Clay_ElementData data = Clay_GetElementData(CLAY_IDI("code_block", range->node));
+        if (!data.found) {
+            continue;
+        }
+
+        unsigned first_line, end_line;
+        get_visible_code_lines(data.boundingBox.y + CODE_BLOCK_PADDING, detail->line_count,
+                               &first_line, &end_line);
+        if (first_line < range->first_line || end_line > range->end_line) {
+            incomplete = true;
+        }
+    }
+    return incomplete;
+}
+
+static void render_quote_block(NodeIndex node, float available_width) {
     const float padding_top = 16;
     const float padding_right = 16;
     const float padding_bottom = 16;
@@ -836,14 +1611,15 @@ static void render_quote_block(MarkdownNode* node, float available_width) {
     }) {
         float content_width = available_width - total_horizontal_padding;
 
-        for (MarkdownNode* child = node->first_child; child; child = child->next_sibling) {
+        for (NodeIndex child = node_first_child(g_tree, node); child != NODE_NONE;
+                child = node_next_sibling(g_tree, child)) {
             render_node(child, content_width);
         }
     }
 }
 
-static void render_ordered_list(MarkdownNode* current_node, float available_width) {
-    if (!current_node->first_child) {
+static void render_ordered_list(NodeIndex current_node, float available_width) {
+    if (node_first_child(g_tree, current_node) == NODE_NONE) {
         return;
     }
 
@@ -852,7 +1628,7 @@ static void render_ordered_list(MarkdownNode* current_node, float available_widt
     int previous_indices[10];
     memcpy(previous_indices, g_list_item_indexes, sizeof(g_list_item_indexes));
 
-    MD_BLOCK_OL_DETAIL* detail = (MD_BLOCK_OL_DETAIL*) current_node->value.block.detail;
+    MD_BLOCK_OL_DETAIL* detail = (MD_BLOCK_OL_DETAIL*) node_block(g_tree, current_node)->detail;
     g_current_depth++;
     g_list_item_indexes[g_current_depth - 1] = detail->start;
 
@@ -875,8 +1651,8 @@ static void render_ordered_list(MarkdownNode* current_node, float available_widt
     }) {
         float content_width = available_width - total_horizontal_padding;
 
-        for (MarkdownNode* child = current_node->first_child; child;
-                child = child->next_sibling) {
+        for (NodeIndex child = node_first_child(g_tree, current_node); child != NODE_NONE;
+                child = node_next_sibling(g_tree, child)) {
             render_node(child, content_width);
         }
     }
@@ -886,8 +1662,8 @@ static void render_ordered_list(MarkdownNode* current_node, float available_widt
     g_current_depth = previous_depth;
 }
 
-static void render_unordered_list(MarkdownNode* current_node, float available_width) {
-    if (!current_node->first_child) {
+static void render_unordered_list(NodeIndex current_node, float available_width) {
+    if (node_first_child(g_tree, current_node) == NODE_NONE) {
         return;
     }
 
@@ -911,15 +1687,15 @@ static void render_unordered_list(MarkdownNode* current_node, float available_wi
         // Subtract horizontal padding from available width
         float content_width = available_width - total_horizontal_padding;
 
-        for (MarkdownNode* child = current_node->first_child; child;
-                child = child->next_sibling) {
+        for (NodeIndex child = node_first_child(g_tree, current_node); child != NODE_NONE;
+                child = node_next_sibling(g_tree, child)) {
             render_node(child, content_width);
         }
     }
 }
 
-static void render_list_item(MarkdownNode* current_node, float available_width) {
-    if (!current_node->first_child) return;
+static void render_list_item(NodeIndex current_node, float available_width) {
+    if (node_first_child(g_tree, current_node) == NODE_NONE) return;
 
     const float padding_left = 8;
     const float child_gap = 8;
@@ -927,7 +1703,7 @@ static void render_list_item(MarkdownNode* current_node, float available_width)
     // Calculate available width for text content subtracting bullet space and padding
     float text_available_width = available_width - bullet_and_padding;
 
-    textline_init();
+    textline_init(text_available_width);
 
     CLAY_AUTO_ID({
         .layout = {
@@ -963,7 +1739,8 @@ static void render_list_item(MarkdownNode* current_node, float available_width)
                 .sizing = { .width = CLAY_SIZING_FIT(0, available_width) },
             },
         }) {
-            for (MarkdownNode* child = current_node->first_child; child; child = child->next_sibling) {
+            for (NodeIndex child = node_first_child(g_tree, current_node); child != NODE_NONE;
+                child = node_next_sibling(g_tree, child)) {
                 render_node(child, text_available_width);
             }
             textline_flush();
@@ -975,17 +1752,21 @@ static void render_list_item(MarkdownNode* current_node, float available_width)
     }
 }
 
-static void render_image(MarkdownNode *node, float available_width) {
-    MD_SPAN_IMG_DETAIL *detail = (MD_SPAN_IMG_DETAIL*) node->value.span.detail;
-    MD_ATTRIBUTE src = detail->src;
+static void render_image(NodeIndex node, float available_width) {
+    ImageDetail *detail = (ImageDetail*) node_span(g_tree, node)->detail;
     MD_ATTRIBUTE title = detail->src;
 
-    ImageInfo *info = find_or_load_image(src.text, src.size);
-
     float content_width = available_width * IMG_SCALING_FACTOR;
 
-    // Display the image
-    if (info->is_image_loaded) {
+    // Images are never drawn wider than this, which in framebuffer pixels (high DPI screens
+    // have more of them) is the width they are decoded at
+    float max_width = content_width - content_width / 6;
+    float pixel_scale = (float)GetRenderWidth() / GetScreenWidth();
+    ImageInfo *info = get_image(detail, max_width * pixel_scale);
+
+    // Display the image. Once its size is known, an image that is loading (again) keeps its
+    // box, so the layout does not jump when it shows up.
+    if (info->width > 0) {
         CLAY_AUTO_ID({
             .layout = {
                 .childAlignment = CLAY_ALIGN_X_CENTER,
@@ -993,9 +1774,8 @@ static void render_image(MarkdownNode *node, float available_width) {
                 .padding = {content_width / 6, 0, 28, 28},
             },
         }) {
-            float max_width = content_width;
-            float original_width = (float)info->image.width;
-            float original_height = (float)info->image.height;
+            float original_width = (float)info->width;
+            float original_height = (float)info->height;
 
             // Scale the image if too big, if not, then keep the original size
             float width = (original_width > content_width) ? content_width : original_width;
@@ -1008,7 +1788,7 @@ static void render_image(MarkdownNode *node, float available_width) {
                 .layout = {
                     .sizing = { .width = CLAY_SIZING_FIXED(width), .height = CLAY_SIZING_FIXED(height) }
                 },
-                .image = { .imageData = &info->image }
+                .image = { .imageData = info->state == IMAGE_LOADED ? &info->image : NULL }
             }) { }
         }
     } else {
@@ -1022,7 +1802,7 @@ static void render_image(MarkdownNode *node, float available_width) {
     }
 }
 
-static void render_paragraph(MarkdownNode* current_node, float available_width) {
+static void render_paragraph(NodeIndex current_node, float available_width) {
     const float padding = 1;
     const float child_gap = 2;
     const float total_spacing = padding * 2 + child_gap;
@@ -1036,19 +1816,45 @@ static void render_paragraph(MarkdownNode* current_node, float available_width)
         },
         .backgroundColor = COLOR_BACKGROUND,
     }) {
-        textline_init();
-        for (MarkdownNode* child = current_node->first_child; child;
-                child = child->next_sibling) {
-            render_node(child, available_width);
+        float line_width = available_width - padding * 2;
+        const LineCacheEntry *cached = line_cache_find(current_node, line_width);
+        if (cached) {
+            line_cache_replay(cached);
+        } else {
+            // Only text goes through the line breaker, images lay themselves out
+            bool cacheable = true;
+            for (NodeIndex child = node_first_child(g_tree, current_node); child != NODE_NONE;
+                    child = node_next_sibling(g_tree, child)) {
+                if (node_type(g_tree, child) == NODE_SPAN
+                        && node_span(g_tree, child)->type == MD_SPAN_IMG) {
+                    cacheable = false;
+                }
+            }
+
+            if (cacheable) {
+                line_cache_begin();
+            }
+            uint32_t first_element = g_line_cache.element_count;
+            uint32_t first_line = g_line_cache.line_count;
+
+            textline_init(line_width);
+            for (NodeIndex child = node_first_child(g_tree, current_node); child != NODE_NONE;
+                    child = node_next_sibling(g_tree, child)) {
+                render_node(child, available_width);
+            }
+            textline_flush();
+
+            if (cacheable) {
+                line_cache_end(current_node, line_width, first_element, first_line);
+            }
         }
-        textline_flush();
     }
 }
 
-static void render_block(MarkdownNode* current_node, float available_width) {
+static void render_block(NodeIndex current_node, float available_width) {
     ListMode previous_list_mode = g_current_list_mode;
 
-    switch (current_node->value.block.type) {
+    switch (node_block(g_tree, current_node)->type) {
     case MD_BLOCK_P:
         render_paragraph(current_node, available_width);
         break;
@@ -1094,11 +1900,11 @@ static void render_block(MarkdownNode* current_node, float available_width) {
     g_current_list_mode = previous_list_mode;
 }
 
-static void render_node(MarkdownNode* current_node, float available_width) {
-    NodeType type = current_node->type;
+static void render_node(NodeIndex current_node, float available_width) {
+    NodeType type = node_type(g_tree, current_node);
     if (type == NODE_BLOCK) {
         render_block(current_node, available_width);
-    } else if (type == NODE_SPAN && current_node->value.span.type == MD_SPAN_IMG) {
+    } else if (type == NODE_SPAN && node_span(g_tree, current_node)->type == MD_SPAN_IMG) {
         render_image(current_node, available_width);
     } else if (type == NODE_SPAN || type == NODE_TEXT) {
         render_text_node(current_node, available_width);
@@ -1109,8 +1915,160 @@ static void render_node(MarkdownNode* current_node, float available_width) {
 // MAIN LAYOUT AND RENDERING
 // ============================================================================
 
+#define MAIN_PADDING_TOP 46
+#define MAIN_CHILD_GAP 16
+
+static Clay_Vector2 get_main_scroll_offset(void) {
+    Clay_ScrollContainerData data = Clay_GetScrollContainerData(CLAY_ID(MAIN_LAYOUT_ID));
+    if (!data.found || !data.scrollPosition) {
+        return (Clay_Vector2) {0};
+    }
+    return *data.scrollPosition;
+}
+
+// Moves the view down by shift pixels of content
+static void shift_main_scroll(float shift) {
+    Clay_ScrollContainerData data = Clay_GetScrollContainerData(CLAY_ID(MAIN_LAYOUT_ID));
+    if (data.found && data.scrollPosition) {
+        data.scrollPosition->y -= shift;
+    }
+}
+
+// Rough height of a block that has never been laid out, based on the amount of text it holds.
+// The subtree of a top-level block is a contiguous range of nodes, so it is scanned linearly.
+static float estimate_block_height(const TopLevelBlock *block, float available_width) {
+    int chars = 0;
+    int line_breaks = 0;
+    for (NodeIndex i = block->node; i < block->subtree_end; i++) {
+        if (node_type(g_tree, i) == NODE_BLOCK && node_block(g_tree, i)->type == MD_BLOCK_CODE) {
+            // Code does not wrap, its line index already has the answer. Skip its text node.
+            const CodeBlockDetail *detail = node_block(g_tree, i)->detail;
+            line_breaks += detail->line_count;
+            i++;
+            continue;
+        }
+        if (node_type(g_tree, i) != NODE_TEXT) {
+            continue;
+        }
+        const TextNode *text = node_text(g_tree, i);
+        chars += text->size;
+        if (text->type == MD_TEXT_BR) {
+            line_breaks++;
+        }
+    }
+
+    int chars_per_line = (int)(available_width / (g_base_font_size * 0.5f));
+    if (chars_per_line <= 0) {
+        chars_per_line = 80;
+    }
+    int lines = chars / chars_per_line + line_breaks + 1;
+    return lines * (g_base_font_size + 2);
+}
+
+static void splice_block_extents(const DocumentSplice *splice);
+
+// The text is measured with other faces now, prepare_block_extents() starts over
+static void invalidate_text_layout(void) {
+    g_block_extents_width = -1;
+    word_cache_clear();
+}
+
+// Allocates the extents table on first use, adds the blocks parsed since the last layout, and
+// resets every block to an estimate when the width or the font size changes, as the measured
+// heights are no longer valid.
+static void prepare_block_extents(float available_width) {
+    if (!g_block_extents) {
+        g_block_count = g_document->block_count;
+        g_block_extents = calloc(g_block_count ? g_block_count : 1, sizeof(BlockExtent));
+        if (!g_block_extents) {
+            perror("Error allocating block extents");
+            exit(1);
+        }
+        g_block_extents_width = -1;
+    }
+
+    if ((int)g_document->block_count > g_block_count) {
+        splice_block_extents(&(DocumentSplice) {
+            .first_block = g_block_count,
+            .removed = 0,
+            .inserted = g_document->block_count - g_block_count,
+        });
+    }
+
+    if (g_block_extents_width == available_width
+            && g_block_extents_font_size == g_base_font_size) {
+        return;
+    }
+
+    // Every wrapped line is outdated too
+    line_cache_clear();
+
+    for (int i = 0; i < g_block_count; i++) {
+        g_block_extents[i].height = estimate_block_height(&g_document->blocks[i], available_width);
+        g_block_extents[i].measured = false;
+    }
+    g_block_extents_width = available_width;
+    g_block_extents_font_size = g_base_font_size;
+}
+
+// Follows a splice of the document: blocks that were kept move along with their measured
+// heights, the new ones start with an estimate.
+static void splice_block_extents(const DocumentSplice *splice) {
+    if (!g_block_extents) {
+        return;
+    }
+
+    int new_count = g_block_count - splice->removed + splice->inserted;
+    int kept_after = g_block_count - splice->first_block - splice->removed;
+    if (new_count > g_block_count) {
+        g_block_extents = realloc(g_block_extents, new_count * sizeof(BlockExtent));
+        if (!g_block_extents) {
+            perror("Error allocating block extents");
+            exit(1);
+        }
+    }
+    memmove(g_block_extents + splice->first_block + splice->inserted,
+            g_block_extents + splice->first_block + splice->removed,
+            kept_after * sizeof(BlockExtent));
+    g_block_count = new_count;
+
+    g_tree = &g_document->tree;
+    for (uint32_t i = splice->first_block; i < splice->first_block + splice->inserted; i++) {
+        g_block_extents[i].height = estimate_block_height(&g_document->blocks[i],
+                                                          g_block_extents_width);
+        g_block_extents[i].measured = false;
+    }
+}
+
+// Reads back the heights of the blocks laid out this frame. Returns true if any of them
+// differs from the value used to place the spacers, which means another layout is needed.
+// anchor_shift gets how much the blocks above the first one on screen grew.
+static bool update_block_extents(float *anchor_shift) {
+    bool changed = false;
+    *anchor_shift = 0;
+    for (int i = g_first_visible_block; i <= g_last_visible_block; i++) {
+        Clay_ElementData data = Clay_GetElementData(CLAY_IDI("md_block", i));
+        if (!data.found) {
+            continue;
+        }
+        if (!g_block_extents[i].measured || g_block_extents[i].height != data.boundingBox.height) {
+            changed = true;
+        }
+        if (i < g_first_screen_block) {
+            *anchor_shift += data.boundingBox.height - g_block_extents[i].height;
+        }
+        g_block_extents[i].height = data.boundingBox.height;
+        g_block_extents[i].measured = true;
+    }
+    return changed;
+}
+
 static Clay_RenderCommandArray render_markdown_tree(void) {
-    MarkdownNode* root_node = get_root_node();
+    g_tree = &g_document->tree;
+    g_layout_serial++;
+    g_code_block_ranges = NULL;
+    g_code_block_range_count = 0;
+    g_code_block_ranges_capacity = 0;
 
     Clay_BeginLayout();
 
@@ -1118,12 +2076,21 @@ static Clay_RenderCommandArray render_markdown_tree(void) {
     int right_padding = (int)(GetScreenWidth() / 7); // Same here, but looks nice.
     float available_width = GetScreenWidth() - left_padding - right_padding;
 
+    prepare_block_extents(available_width);
+
+    // Visible region in the coordinates of the main container contents
+    float prefetch_margin = GetScreenHeight() * VIEWPORT_PREFETCH_SCREENS;
+    float view_top = -get_main_scroll_offset().y - prefetch_margin;
+    float view_bottom = view_top + GetScreenHeight() + prefetch_margin * 2;
+    float screen_top = view_top + prefetch_margin;
+    float screen_bottom = view_bottom - prefetch_margin;
+
     // Main app container
     CLAY(CLAY_ID(MAIN_LAYOUT_ID), {
         .layout = {
             .layoutDirection = CLAY_TOP_TO_BOTTOM,
-            .padding = { left_padding, 0, 46, right_padding },
-            .childGap = 16,
+            .padding = { left_padding, 0, MAIN_PADDING_TOP, right_padding },
+            .childGap = MAIN_CHILD_GAP,
             .childAlignment = { .x = CLAY_ALIGN_X_LEFT },
             .sizing = {
                 .width = CLAY_SIZING_GROW(0),
@@ -1137,9 +2104,50 @@ static Clay_RenderCommandArray render_markdown_tree(void) {
             .childOffset = Clay_GetScrollOffset()
         }
     }) {
-        for (MarkdownNode* child = root_node->first_child; child; child = child->next_sibling) {
-            render_node(child, available_width);
+        g_first_visible_block = 0;
+        g_last_visible_block = -1;
+        g_first_screen_block = g_block_count;
+
+        // Consecutive off-screen blocks are collapsed into a single spacer. Its height
+        // accumulates the gaps between those blocks too, minus the one Clay adds itself.
+        float spacer_height = 0;
+        float y = MAIN_PADDING_TOP;
+
+        for (int index = 0; index < g_block_count; index++) {
+            float height = g_block_extents[index].height;
+            bool visible = y + height >= view_top && y <= view_bottom;
+            if (g_first_screen_block == g_block_count && y + height >= screen_top) {
+                g_first_screen_block = index;
+            }
+
+            if (visible) {
+                render_spacer(spacer_height - MAIN_CHILD_GAP);
+                spacer_height = 0;
+
+                if (g_last_visible_block < 0) {
+                    g_first_visible_block = index;
+                }
+                g_last_visible_block = index;
+
+                // Images of the blocks on screen load first, then the ones nearest to it
+                g_block_distance = y > screen_bottom ? y - screen_bottom :
+                                   (y + height < screen_top ? screen_top - y - height : 0);
+
+                CLAY(CLAY_IDI("md_block", index), {
+                    .layout = {
+                        .layoutDirection = CLAY_TOP_TO_BOTTOM,
+                        .sizing = { .width = CLAY_SIZING_GROW(0) }
+                    },
+                }) {
+                    render_node(g_document->blocks[index].node, available_width);
+                }
+            } else {
+                spacer_height += height + MAIN_CHILD_GAP;
+            }
+
+            y += height + MAIN_CHILD_GAP;
         }
+        render_spacer(spacer_height - MAIN_CHILD_GAP);
     }
 
     return Clay_EndLayout();
@@ -1172,7 +2180,8 @@ static ScrollKey g_scroll_keys[] = {
     {.key = KEY_U, .direction = {0,  1}, .timer = 0, .repeating = false, .screen_portion = 0.095f},   // half page up
 };
 
-static void handle_vim_scroll_motions(void) {
+// Returns the scroll delta to apply this frame, or a zero vector once the motion has settled.
+static Vector2 handle_vim_scroll_motions(void) {
     float screen_height = GetScreenHeight();
     float delta_time = GetFrameTime();
     Vector2 scroll_delta = {0};
@@ -1227,20 +2236,208 @@ static void handle_vim_scroll_motions(void) {
     smoothed_scroll.y += (scroll_delta.y - smoothed_scroll.y) * smoothing_factor * delta_time;
 
     if (fabsf(smoothed_scroll.x) > 0.01f || fabsf(smoothed_scroll.y) > 0.01f) {
-        Clay_UpdateScrollContainers(
-            true,
-        (Clay_Vector2) {
-            smoothed_scroll.x, smoothed_scroll.y
-        },
-        delta_time
-        );
+        return smoothed_scroll;
     }
+    return (Vector2) {0};
+}
+
+// ============================================================================
+// BACKGROUND PARSING
+// ============================================================================
+
+static void *parse_document_async(void *args) {
+    MarkdownDocument *document = args;
+
+    bool parsed = true;
+    while (parsed && !document_is_parsed(document)
+            && !__atomic_load_n(&g_stop_parsing, __ATOMIC_ACQUIRE)) {
+        // A layout pass goes first, the parser can wait for it
+        while (__atomic_load_n(&g_layout_waiting, __ATOMIC_ACQUIRE)) {
+            sched_yield();
+        }
+
+        pthread_mutex_lock(&g_document_mutex);
+        parsed = parse_next_chunk(document);
+        pthread_mutex_unlock(&g_document_mutex);
+
+        __atomic_store_n(&g_parsed_chunks, document->parsed_chunks, __ATOMIC_RELEASE);
+    }
+
+    if (!parsed) {
+        fprintf(stderr, "Error: Cannot parse file '%s'\n", g_viewer_document->file_name);
+    }
+    __atomic_store_n(&g_parsing, 0, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// The rest of the document is read in whatever order the renderer needs, so drop the
+// sequential hint the parser asked for (it lets the kernel evict pages right behind it).
+static void finish_parsing(void) {
+    const FileContent *file = &g_viewer_document->file;
+    if (file->is_mapped) {
+        madvise(file->data, file->size, MADV_NORMAL);
+    }
+    if (g_viewer_document->watch) {
+        watcher_start(&g_watcher, g_viewer_document->file_name);
+    }
+}
+
+static void start_parsing(void) {
+    if (document_is_parsed(g_viewer_document->document)) {
+        finish_parsing();
+        return;
+    }
+
+    g_parsing = 1;
+    int ret_val = pthread_create(&g_parse_thread, NULL, parse_document_async,
+                                 g_viewer_document->document);
+    if (ret_val != 0) {
+        fprintf(stderr, "Error creating thread: %d\n", ret_val);
+        exit(1);
+    }
+    g_parse_thread_running = true;
+}
+
+// Returns true if new blocks were parsed since the last layout
+static bool update_parse_progress(void) {
+    if (!g_parse_thread_running) {
+        return false;
+    }
+
+    if (!__atomic_load_n(&g_parsing, __ATOMIC_ACQUIRE)) {
+        pthread_join(g_parse_thread, NULL);
+        g_parse_thread_running = false;
+        finish_parsing();
+        return true; // Also hides the progress bar
+    }
+    return __atomic_load_n(&g_parsed_chunks, __ATOMIC_ACQUIRE) != g_drawn_chunks;
+}
+
+static void lock_document(void) {
+    if (!g_parse_thread_running) {
+        return;
+    }
+    __atomic_store_n(&g_layout_waiting, 1, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&g_document_mutex);
+    __atomic_store_n(&g_layout_waiting, 0, __ATOMIC_RELEASE);
+    g_drawn_chunks = g_document->parsed_chunks;
+}
+
+static void stop_parsing(void) {
+    if (!g_parse_thread_running) {
+        return;
+    }
+    __atomic_store_n(&g_stop_parsing, 1, __ATOMIC_RELEASE);
+    pthread_join(g_parse_thread, NULL);
+    g_parse_thread_running = false;
+}
+
+static void unlock_document(void) {
+    if (g_parse_thread_running) {
+        pthread_mutex_unlock(&g_document_mutex);
+    }
+}
+
+// Thin bar along the top of the window, filled with the share of the source parsed so far
+static void draw_parse_progress(void) {
+    if (!g_parse_thread_running || g_document->source_size == 0) {
+        return;
+    }
+
+    // The chunk list does not change while parsing, only the count of parsed ones
+    uint32_t parsed_chunks = __atomic_load_n(&g_parsed_chunks, __ATOMIC_ACQUIRE);
+    size_t parsed_size = parsed_chunks ? g_document->chunks[parsed_chunks - 1].end : 0;
+    float progress = (float)parsed_size / g_document->source_size;
+    Clay_Color color = COLOR_BLUE;
+    DrawRectangle(0, 0, (int)(GetScreenWidth() * progress), PARSE_PROGRESS_HEIGHT,
+                  (Color) { color.r, color.g, color.b, color.a });
+}
+
+// ============================================================================
+// LIVE RELOAD
+// ============================================================================
+
+// Loads the new version of the watched file and updates the document in place. Only the
+// changed blocks are reparsed, the rest keep their nodes and their measured heights, and the
+// scroll position and the loaded images are left alone.
+static bool reload_document(void) {
+    FileContent file;
+    if (!load_file(g_viewer_document->file_name, false, &file)) {
+        return false; // Keep showing the previous version
+    }
+
+    DocumentSplice splice;
+    bool parsed = update_markdown(g_viewer_document->document, file.data, file.size, &splice);
+    if (g_viewer_document->document->source != file.data) {
+        // Rejected, the document still references the previous contents
+        release_file(&file);
+        fprintf(stderr, "Error: Cannot parse file '%s'\n", g_viewer_document->file_name);
+        return false;
+    }
+
+    // The document references the new contents from now on, even if parsing failed
+    release_file(&g_viewer_document->file);
+    g_viewer_document->file = file;
+    splice_block_extents(&splice);
+    line_cache_clear(); // Cached lines point into the previous contents
+    word_cache_clear();
+
+    if (!parsed) {
+        fprintf(stderr, "Error: Cannot parse file '%s'\n", g_viewer_document->file_name);
+    }
+    return true;
 }
 
 // ============================================================================
 // MAIN LOOP AND APPLICATION CONTROL
 // ============================================================================
 
+// Everything that can change the output of a layout pass. If two consecutive frames share the
+// same state, the previous render commands are still valid and the frame can be skipped.
+typedef struct {
+    int screen_width;
+    int screen_height;
+    int font_size;
+    bool debug_enabled;
+    Clay_Vector2 pointer_position;
+    bool pointer_down;
+    Clay_Vector2 scroll_offset;
+} FrameState;
+
+// Time to sleep on idle frames, as nothing drives the frame rate when drawing is skipped.
+#define IDLE_FRAME_WAIT (1.0 / 60.0)
+
+static FrameState g_last_frame_state;
+static bool g_has_frame = false;
+static bool g_scroll_in_motion = false;
+static bool g_needs_relayout = false;
+static Clay_RenderCommandArray g_render_commands;
+
+static FrameState capture_frame_state(void) {
+    Vector2 mouse_position = GetMousePosition();
+    return (FrameState) {
+        .screen_width = GetScreenWidth(),
+        .screen_height = GetScreenHeight(),
+        .font_size = g_base_font_size,
+        .debug_enabled = Clay_IsDebugModeEnabled(),
+        .pointer_position = RAYLIB_VECTOR2_TO_CLAY_VECTOR2(mouse_position),
+        .pointer_down = IsMouseButtonDown(0),
+        .scroll_offset = get_main_scroll_offset(),
+    };
+}
+
+static bool frame_state_equals(const FrameState *a, const FrameState *b) {
+    return a->screen_width == b->screen_width
+           && a->screen_height == b->screen_height
+           && a->font_size == b->font_size
+           && a->debug_enabled == b->debug_enabled
+           && a->pointer_position.x == b->pointer_position.x
+           && a->pointer_position.y == b->pointer_position.y
+           && a->pointer_down == b->pointer_down
+           && a->scroll_offset.x == b->scroll_offset.x
+           && a->scroll_offset.y == b->scroll_offset.y;
+}
+
 static void update_frame(void) {
     // Handle debug toggle
     if (IsKeyPressed(KEY_BACKSPACE)) {
@@ -1258,52 +2455,111 @@ static void update_frame(void) {
         reset_font_styles();
     }
 
+    // Collect scroll input. The vim motions are smoothed, so they keep producing deltas for a
+    // few frames after the key is released.
+    Vector2 scroll_delta = GetMouseWheelMoveV();
+    bool wheel_scrolled = scroll_delta.x != 0 || scroll_delta.y != 0;
+    if (wheel_scrolled) {
+        scroll_delta.y *= SCROLL_MULTIPLIER;
+    } else {
+        scroll_delta = handle_vim_scroll_motions();
+    }
+    bool scroll_requested = scroll_delta.x != 0 || scroll_delta.y != 0;
+
+    // Load pending textures (images). A new texture changes the layout of its image element.
+    bool textures_updated = update_pending_textures();
+
+    bool parse_progressed = update_parse_progress();
+    bool fonts_loaded = update_font_loading();
+    bool document_reloaded = watcher_poll(&g_watcher) && reload_document();
+
+    FrameState state = capture_frame_state();
+    bool dirty = !g_has_frame
+                 || scroll_requested
+                 || g_scroll_in_motion
+                 || g_needs_relayout
+                 || textures_updated
+                 || parse_progressed
+                 || fonts_loaded
+                 || document_reloaded
+                 || state.debug_enabled  // Clay debug panel has its own interactive state
+                 || !frame_state_equals(&state, &g_last_frame_state);
+
+    // Nothing changed since the last frame: the previous render commands are still on screen,
+    // so skip the layout and the redraw and just keep the input events flowing.
+    // NOTE: Clay_UpdateScrollContainers() must not run here, it drops every scroll container
+    // that was not declared by a layout pass since the last call.
+    if (!dirty) {
+        PollInputEvents();
+        WaitTime(IDLE_FRAME_WAIT);
+        return;
+    }
+
     // Update layout dimensions for window resizing
     Clay_SetLayoutDimensions((Clay_Dimensions) {
-        .width = GetScreenWidth(),
-        .height = GetScreenHeight()
+        .width = state.screen_width,
+        .height = state.screen_height
     });
 
-    // Calculate available characters per line
-    g_available_characters = (int)(GetScreenWidth() / (g_base_font_size / 2) - 1);
-
     // Update input state
-    Vector2 mouse_position = GetMousePosition();
-    Clay_SetPointerState(
+    Clay_SetPointerState(state.pointer_position, state.pointer_down);
+
+    // Drag scrolling needs to be updated every frame, even with no wheel or key input, so
+    // the scroll momentum keeps going after the pointer is released.
+    Clay_UpdateScrollContainers(
+        true,
     (Clay_Vector2) {
-        mouse_position.x, mouse_position.y
+        scroll_delta.x, scroll_delta.y
     },
-    IsMouseButtonDown(0)
+    GetFrameTime()
     );
 
-    // Handle mouse wheel scrolling
-    Vector2 scroll_delta = GetMouseWheelMoveV();
-    if (scroll_delta.x != 0 || scroll_delta.y != 0) {
-        Clay_UpdateScrollContainers(
-            true,
-        (Clay_Vector2) {
-            scroll_delta.x, scroll_delta.y * SCROLL_MULTIPLIER
-        },
-        GetFrameTime()
-        );
-    } else {
-        // Handle vim-style keyboard scrolling
-        handle_vim_scroll_motions();
+    // The previous render commands point into the frame arena, so it must stay alive until a
+    // new layout replaces them.
+    arena_reset(&g_frame_arena);
+
+    // Generate render commands. Text in the commands points into the source or the document
+    // arena, which stay put while the parser keeps going, so only the layout needs the lock.
+    lock_document();
+    g_render_commands = render_markdown_tree();
+
+    // Spacers were sized with estimates for the blocks that just became visible, and code
+    // blocks picked their lines from the previous layout, so run another layout on the next
+    // frame if any of that turned out to be wrong.
+    float anchor_shift;
+    g_needs_relayout = update_block_extents(&anchor_shift);
+    if (anchor_shift != 0) {
+        // Blocks above the screen (scrolling up after a jump to the bottom) came out taller or
+        // shorter than their estimate and moved what is on screen. Scroll by the same amount
+        // and lay out again, so this frame already shows the content where it was.
+        shift_main_scroll(anchor_shift);
+        arena_reset(&g_frame_arena);
+        g_render_commands = render_markdown_tree();
+        g_needs_relayout = update_block_extents(&anchor_shift);
+        shift_main_scroll(anchor_shift);
     }
+    g_needs_relayout |= check_code_block_ranges();
+    unlock_document();
+
+    // Images that scrolled out of the laid out region stop waiting for a worker, and give
+    // their textures back if there are too many
+    image_loader_cancel_stale(&g_image_loader, g_layout_serial);
+    evict_image_textures();
+
+    // Keep drawing while the scroll offset settles (momentum or smoothing), then go idle.
+    Clay_Vector2 scroll_offset = get_main_scroll_offset();
+    g_scroll_in_motion = scroll_offset.x != state.scroll_offset.x
+                         || scroll_offset.y != state.scroll_offset.y;
+    state.scroll_offset = scroll_offset;
 
-    // Generate render commands
-    Clay_RenderCommandArray render_commands = render_markdown_tree();
+    g_last_frame_state = state;
+    g_has_frame = true;
 
     // Render frame
     BeginDrawing();
     ClearBackground(WHITE);
-
-    update_pending_textures(); // Load pending textures (images)
-    Clay_Raylib_Render(render_commands, g_fonts, FONT_ID_EMOJI);
-
-    // Clean up temporary text buffers
-    free_all_temp_text_buffers();
-
+    Clay_Raylib_Render(g_render_commands, g_fonts);
+    draw_parse_progress();
     EndDrawing();
 }
 
@@ -1337,15 +2593,35 @@ void start_main_loop(void) {
 // ============================================================================
 
 void cleanup_application(void) {
-    if (g_temp_text_buffers) {
-        free_all_temp_text_buffers();
-        free(g_temp_text_buffers);
-        g_temp_text_buffers = NULL;
+    stop_parsing();
+
+    arena_release(&g_frame_arena);
+    line_cache_release();
+    word_cache_release();
+    Raylib_FreeGlyphTables();
+    Raylib_FreeGlyphRuns();
+    wait_for_fonts();
+    for (int i = 0; i < FONT_COUNT; i++) {
+        glyph_atlas_close(&g_glyph_atlases[i]);
     }
+    Raylib_UnloadSdfShader();
+    image_loader_stop(&g_image_loader);
     clean_images_array();
+
+    free(g_block_extents);
+    g_block_extents = NULL;
+    g_block_count = 0;
+
+    watcher_stop(&g_watcher);
 }
 
-void initialize_application(char *app_root) {
+void initialize_application(char *app_root, ViewerDocument *viewer_document) {
+    g_viewer_document = viewer_document;
+    g_document = viewer_document->document;
+
+    // The window and the fonts come up while the document is being parsed
+    start_parsing();
+
     // Resources initialization
     init_resource_path(app_root);
     initialize_freetype();
@@ -1,7 +1,23 @@
 #ifndef UI_RENDERER_H
 #define UI_RENDERER_H
 
-void initialize_application();
-void start_main_loop();
+#include "file.h"
+#include "parser.h"
+
+// Document shown by the viewer. When watched, the file is reloaded whenever it changes on disk
+// and both the file contents and the document are updated in place.
+typedef struct {
+    const char *file_name;
+    FileContent file;
+    MarkdownDocument *document;
+    bool watch;
+} ViewerDocument;
+
+// GPU memory the image textures may take, past it the off-screen ones are unloaded
+void set_texture_budget(size_t megabytes);
+
+// Opens the viewer window for the given document and blocks until it is closed
+void initialize_application(char *app_root, ViewerDocument *viewer_document);
+void start_main_loop(void);
 
 #endif // UI_RENDERER_H
@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "watcher.h"
+
+bool watcher_start(FileWatcher *watcher, const char *path) {
+    *watcher = (FileWatcher) {
+        .fd = -1,
+        .watch = -1,
+    };
+
+#ifdef __linux__
+    const char *slash = strrchr(path, '/');
+    watcher->directory = slash ? strndup(path, slash - path + 1) : strdup(".");
+    watcher->name = strdup(slash ? slash + 1 : path);
+    if (!watcher->directory || !watcher->name) {
+        printf("Cannot allocate heap memmory");
+        exit(1);
+    }
+
+    watcher->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watcher->fd < 0) {
+        perror("Error: Cannot watch file");
+        watcher_stop(watcher);
+        return false;
+    }
+
+    // Written in place, or replaced by a rename
+    watcher->watch = inotify_add_watch(watcher->fd, watcher->directory,
+                                       IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (watcher->watch < 0) {
+        perror("Error: Cannot watch file");
+        watcher_stop(watcher);
+        return false;
+    }
+    return true;
+#else
+    (void)path;
+    fprintf(stderr, "Warning: File watching is not supported on this platform\n");
+    return false;
+#endif
+}
+
+bool watcher_poll(FileWatcher *watcher) {
+    if (watcher->fd < 0) {
+        return false;
+    }
+
+    bool changed = false;
+#ifdef __linux__
+    // Drain every queued event, a burst of saves only needs one reload
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length;
+    while ((length = read(watcher->fd, buffer, sizeof(buffer))) > 0) {
+        for (char *cursor = buffer; cursor < buffer + length;) {
+            const struct inotify_event *event = (const struct inotify_event *)cursor;
+            if (event->len > 0 && strcmp(event->name, watcher->name) == 0) {
+                changed = true;
+            }
+            cursor += sizeof(struct inotify_event) + event->len;
+        }
+    }
+#endif
+    return changed;
+}
+
+void watcher_stop(FileWatcher *watcher) {
+    if (watcher->fd >= 0) {
+        close(watcher->fd); // Also removes the watch
+    }
+    free(watcher->directory);
+    free(watcher->name);
+    *watcher = (FileWatcher) {
+        .fd = -1,
+        .watch = -1,
+    };
+}
@@ -0,0 +1,20 @@
+#ifndef WATCHER_H
+#define WATCHER_H
+
+#include <stdbool.h>
+
+// Watches a single file for changes (inotify, Linux only). The directory is watched instead of
+// the file itself, as many editors save by writing a new file and renaming it over the old one.
+typedef struct {
+    int fd;
+    int watch;
+    char *directory;
+    char *name;     // file name inside the directory
+} FileWatcher;
+
+bool watcher_start(FileWatcher *watcher, const char *path);
+// Never blocks. Returns true if the file was written or replaced since the last call.
+bool watcher_poll(FileWatcher *watcher);
+void watcher_stop(FileWatcher *watcher);
+
+#endif // WATCHER_H